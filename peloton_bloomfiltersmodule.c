@@ -1,16 +1,22 @@
 #include<Python.h>
 #include<fcntl.h>
+#include<pthread.h>
 #include<math.h>
 #include<stddef.h>
 #include<stdint.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<limits.h>
+#include<sched.h>
+#include<signal.h>
 #include<assert.h>
+#include<dirent.h>
+#include<errno.h>
 #include<string.h>
 #include<sys/file.h>
 #include<sys/mman.h>
 #include<sys/stat.h>
+#include<sys/syscall.h>
 #include<sys/types.h>
 #include<unistd.h>
 
@@ -49,12 +55,38 @@ struct magicu_info {
 };
 
 
+// Probe layouts.  LEGACY is how filters without a plan have always
+// been laid out and must stay bit for bit identical so existing files
+// keep working.  STANDARD spreads the probes over the whole array and
+// BLOCKED keeps all of an item's probes in one 512 bit cache line.
+enum {
+  BLOOMFILTER_LEGACY = 0,
+  BLOOMFILTER_STANDARD = 1,
+  BLOOMFILTER_BLOCKED = 2,
+};
+
+#define BLOOMFILTER_BLOCK_BITS 512
+// 32TB of bits; keeps every size and offset derived from a plan, which
+// may come from a file or a caller's dict, far from overflowing.
+#define BLOOMFILTER_MAX_BITS ((uint64_t)1 << 48)
+
+typedef struct {
+  uint64_t capacity;
+  double error_rate;
+  uint64_t bits;
+  int probes;
+  int layout;
+  double predicted_error_rate;
+} bloomfilter_plan_t;
+
 typedef struct {
   int fd;
   uint64_t capacity;
   double error_rate;
   uint64_t length;
+  uint64_t size;
   int probes;
+  int layout;
   void *mmap;
   size_t mmap_size;
   uint64_t *bits;
@@ -65,6 +97,26 @@ typedef struct {
 } bloomfilter_t;
 
 
+// N same-shaped bloomfilters stored bit-sliced: row i holds bit i of
+// every member filter, so a probe reads one N bit row instead of N words.
+typedef struct {
+  int fd;
+  uint64_t capacity;
+  double error_rate;
+  uint64_t filters;
+  uint64_t length;
+  uint64_t row_words;
+  int probes;
+  int layout;
+  void *mmap;
+  size_t mmap_size;
+  uint64_t *counters;
+  uint64_t *rows;
+  uint64_t *scratch;
+  struct magicu_info divisor;
+} multi_bloomfilter_t;
+
+
 typedef struct _peloton_bloomfilter_object SharedMemoryBloomfilterObject;
 typedef struct _peloton_bloomfilter_object ThreadSafeBloomfilterObject;
 typedef struct _peloton_bloomfilter_object BloomfilterObject;
@@ -73,6 +125,11 @@ struct _peloton_bloomfilter_object {
   bloomfilter_t *bf;
 };
 
+typedef struct {
+  PyObject HEAD;
+  multi_bloomfilter_t *mbf;
+} SharedMemoryMultiBloomfilterObject;
+
 
 
 static inline uint64_t rotl(uint64_t x, uint64_t r) {
@@ -162,15 +219,31 @@ struct magicu_info compute_unsigned_magic_info(uint64_t D, uint64_t num_bits) {
   return result;
 }
 
+// n % D using the constants compute_unsigned_magic_info returned for D.
+static inline uint64_t magic_mod(uint64_t n, const struct magicu_info *magic, uint64_t D) {
+  uint64_t quotient = n;
+  if (magic->increment && n != UINT64_MAX)
+    quotient += 1;
+  quotient >>= magic->pre_shift;
+  if (likely(magic->multiplier != 1))
+    quotient = (((__uint128_t)quotient * (__uint128_t)magic->multiplier)) >> 64;
+  quotient >>= magic->post_shift;
+  return n - quotient * D;
+}
+
 
 
-inline int bloomfilter_probes(double error_rate) {
+static inline int bloomfilter_probes(double error_rate) {
   if ((error_rate <= 0) || (error_rate >= 1))
     return -1;
   return (int)(ceil(log(1 / error_rate) / log(2)));
 }
 
 
+// bloomfilter_probes and bloomfilter_size size LEGACY filters.  Files
+// only record capacity and error_rate, so these must not change or
+// existing files would be reopened with a different shape; plan()
+// computes exact parameters instead.
 size_t bloomfilter_size(uint64_t capacity, double error_rate) {
   uint64_t bits = ceil(2 * capacity * fabs(log(error_rate))) / (log(2) * log(2));
   if (bits % (CHAR_BIT * sizeof(uint64_t)))
@@ -178,7 +251,136 @@ size_t bloomfilter_size(uint64_t capacity, double error_rate) {
   return bits;
 }
 
-bloomfilter_t *create_private_bloomfilter(uint64_t capacity, double error_rate) {
+// False positive rate of k probes into m bits holding n items.
+static double bloomfilter_standard_error_rate(double capacity, double bits, int probes) {
+  return pow(-expm1(probes * capacity * log1p(-1.0 / bits)), probes);
+}
+
+// Blocked filters load their blocks unevenly: the items per block are
+// Poisson distributed, and each block behaves like a small standard
+// filter.  Only loads within 12 standard deviations of the mean
+// contribute, which keeps the sum short for any capacity.
+static double bloomfilter_blocked_error_rate(double capacity, double bits, int probes) {
+  double load = capacity / (bits / BLOOMFILTER_BLOCK_BITS);
+  double spread = 12 * sqrt(load) + 32;
+  double rate = 0;
+  double i;
+  for (i = load > spread ? floor(load - spread) : 0; i <= load + spread; ++i)
+    rate += exp(i * log(load) - load - lgamma(i + 1))
+      * bloomfilter_standard_error_rate(i, BLOOMFILTER_BLOCK_BITS, probes);
+  return rate;
+}
+
+static double bloomfilter_plan_error_rate(uint64_t capacity, uint64_t bits, int probes, int layout) {
+  if (layout == BLOOMFILTER_BLOCKED)
+    return bloomfilter_blocked_error_rate(capacity, bits, probes);
+  return bloomfilter_standard_error_rate(capacity, bits, probes);
+}
+
+#define PLAN_MAX_PROBES 32
+#define PLAN_LATENCY_MEMORY_FACTOR 2
+
+// Smallest array, in whole words or blocks, with which probes probes
+// meet error_rate; 0 if none does.  Blocking never lowers the error rate,
+// so a blocked search starts from the standard size.
+static uint64_t bloomfilter_plan_bits(uint64_t capacity, double error_rate, int probes, int layout) {
+  uint64_t unit = layout == BLOOMFILTER_BLOCKED ? BLOOMFILTER_BLOCK_BITS : 64;
+  uint64_t low = 0;
+  uint64_t high;
+  if (layout == BLOOMFILTER_BLOCKED) {
+    uint64_t standard = bloomfilter_plan_bits(capacity, error_rate, probes, BLOOMFILTER_STANDARD);
+    if (!standard)
+      return 0;
+    low = (standard - 64) / unit;
+  }
+  high = low + 1;
+  while (bloomfilter_plan_error_rate(capacity, high * unit, probes, layout) > error_rate) {
+    low = high;
+    high *= 2;
+    if (high * unit > BLOOMFILTER_MAX_BITS)
+      return 0;
+  }
+  while (high - low > 1) {
+    uint64_t middle = low + (high - low) / 2;
+    if (bloomfilter_plan_error_rate(capacity, middle * unit, probes, layout) > error_rate)
+      low = middle;
+    else
+      high = middle;
+  }
+  return high * unit;
+}
+
+// Minimises memory, or for latency the number of probes, allowing up
+// to PLAN_LATENCY_MEMORY_FACTOR times the minimum memory.
+static int bloomfilter_plan(bloomfilter_plan_t *plan, uint64_t capacity, double error_rate, int latency, int layout) {
+  uint64_t bits[PLAN_MAX_PROBES + 1];
+  uint64_t smallest = 0;
+  int probes;
+
+  if ((error_rate <= 0) || (error_rate >= 1) || !capacity)
+    return -1;
+  for (probes = 1; probes <= PLAN_MAX_PROBES; ++probes) {
+    bits[probes] = bloomfilter_plan_bits(capacity, error_rate, probes, layout);
+    if (bits[probes] && (!smallest || bits[probes] < bits[smallest]))
+      smallest = probes;
+  }
+  if (!smallest)
+    return -1;
+  probes = smallest;
+  if (latency)
+    for (probes = 1; probes < smallest; ++probes)
+      if (bits[probes] && bits[probes] <= bits[smallest] * PLAN_LATENCY_MEMORY_FACTOR)
+        break;
+
+  plan->capacity = capacity;
+  plan->error_rate = error_rate;
+  plan->bits = bits[probes];
+  plan->probes = probes;
+  plan->layout = layout;
+  plan->predicted_error_rate = bloomfilter_plan_error_rate(capacity, plan->bits, probes, layout);
+  return 0;
+}
+
+static int bloomfilter_plan_valid(const bloomfilter_plan_t *plan) {
+  if (plan->probes < 1 || plan->probes > 64 || !plan->bits || plan->bits > BLOOMFILTER_MAX_BITS)
+    return 0;
+  if (plan->layout == BLOOMFILTER_STANDARD)
+    return 1;
+  return plan->layout == BLOOMFILTER_BLOCKED && !(plan->bits % BLOOMFILTER_BLOCK_BITS);
+}
+
+// Fills in a plan's shape from words stored in a file or snapshot,
+// rejecting values that would not survive narrowing to int.
+static int bloomfilter_plan_from_shape(bloomfilter_plan_t *plan, uint64_t bits, uint64_t probes, uint64_t layout) {
+  if (probes > 64 || layout > BLOOMFILTER_BLOCKED)
+    return 0;
+  plan->bits = bits;
+  plan->probes = probes;
+  plan->layout = layout;
+  return bloomfilter_plan_valid(plan);
+}
+
+// Sets probes, length and the divisor from a plan, or from capacity and
+// error_rate for a LEGACY filter when plan is NULL.
+static void bloomfilter_shape(bloomfilter_t *bf, const bloomfilter_plan_t *plan) {
+  if (plan) {
+    bf->probes = plan->probes;
+    bf->layout = plan->layout;
+    bf->size = plan->bits;
+    bf->length = (plan->bits + 63) / 64;
+  } else {
+    bf->probes = bloomfilter_probes(bf->error_rate);
+    bf->layout = BLOOMFILTER_LEGACY;
+    bf->length = (bloomfilter_size(bf->capacity, bf->error_rate) + 63) / 64;
+    bf->size = bf->length * 64;
+  }
+  if (bf->layout == BLOOMFILTER_BLOCKED)
+    bf->divisor = compute_unsigned_magic_info(bf->size / BLOOMFILTER_BLOCK_BITS, 64);
+  else
+    bf->divisor = compute_unsigned_magic_info(bf->size, 64);
+}
+
+bloomfilter_t *create_private_bloomfilter(uint64_t capacity, double error_rate, const bloomfilter_plan_t *plan) {
   bloomfilter_t *bloomfilter;
   int probes = bloomfilter_probes(error_rate);
   if (probes == -1)
@@ -189,33 +391,103 @@ bloomfilter_t *create_private_bloomfilter(uint64_t capacity, double error_rate)
   bloomfilter->fd = 0;
   bloomfilter->capacity = capacity;
   bloomfilter->error_rate = error_rate;
-  bloomfilter->length = (bloomfilter_size(capacity, error_rate) + 63 ) / 64;
-  bloomfilter->probes = probes;
+  bloomfilter_shape(bloomfilter, plan);
   bloomfilter->mmap_size = 0;
   bloomfilter->mmap = NULL;
-  if (!(bloomfilter->bits = calloc(sizeof(uint64_t), bloomfilter->length))) {
+  if (posix_memalign((void **)&bloomfilter->bits, 64, bloomfilter->length * sizeof(uint64_t))) {
     free(bloomfilter);
     return NULL;
   }
+  memset(bloomfilter->bits, 0, bloomfilter->length * sizeof(uint64_t));
   bloomfilter->counter = &bloomfilter->local_counter;
 
   bloomfilter->local_counter = capacity;
   bloomfilter->invert = 0;
-  bloomfilter->divisor = compute_unsigned_magic_info(bloomfilter->length * 64, 64);
 
   return bloomfilter;
 }
 
 const char HEADER[] = "SharedMemory BloomFilter";
 
-static bloomfilter_t *create_bloomfilter(int fd, uint64_t capacity, double error_rate) {
+// File layout: HEADER, capacity, error_rate, counter and then the bit
+// array, which starts 64 bytes past the counter.  Planned filters keep
+// bits, probes and layout in the first words of that gap, which is zero
+// in LEGACY files, and start their bit array on a cache line.
+#define BLOOMFILTER_COUNTER_OFFSET (24 + sizeof(uint64_t) + sizeof(double))
+#define BLOOMFILTER_PLAN_OFFSET (BLOOMFILTER_COUNTER_OFFSET + sizeof(uint64_t))
+#define BLOOMFILTER_BITS_OFFSET (BLOOMFILTER_COUNTER_OFFSET + sizeof(uint64_t) * sizeof(uint64_t))
+#define BLOOMFILTER_PLANNED_BITS_OFFSET 128
+
+static inline size_t bloomfilter_bits_offset(int layout) {
+  return layout == BLOOMFILTER_LEGACY ? BLOOMFILTER_BITS_OFFSET : BLOOMFILTER_PLANNED_BITS_OFFSET;
+}
+
+// Writes the header of a new filter file; the caller sizes the file.
+static int bloomfilter_write_header(int fd, uint64_t capacity, double error_rate, uint64_t counter, const bloomfilter_plan_t *plan) {
+  uint64_t shape[3] = {0, 0, 0};
+  if (write(fd, HEADER, 24) != 24
+      || write(fd, &capacity, sizeof(uint64_t)) != sizeof(uint64_t)
+      || write(fd, &error_rate, sizeof(double)) != sizeof(double)
+      || write(fd, &counter, sizeof(uint64_t)) != sizeof(uint64_t))
+    return -1;
+  if (!plan)
+    return 0;
+  shape[0] = plan->bits;
+  shape[1] = plan->probes;
+  shape[2] = plan->layout;
+  return write(fd, shape, sizeof(shape)) == sizeof(shape) ? 0 : -1;
+}
+
+static void *map_shared_file(int fd, size_t size) {
+  void *region = mmap(NULL,
+                      size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_HASSEMAPHORE,
+                      fd,
+                      0);
+  if (region == MAP_FAILED)
+    return NULL;
+  madvise(region, size, MADV_RANDOM);
+  return region;
+}
+
+// Older versions sized files 56 bytes short of their bit array but
+// mapped past the end, so processes still running them keep the last
+// bits in the page cache beyond EOF.  Extending the file zeroes that part
+// of the page, so copy out what is reachable first; the caller ORs it
+// back once the file is mapped at full size.
+static int bloomfilter_save_tail(int fd, size_t size, size_t mmap_size, uint64_t **tail, size_t *words) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t reachable = (size + page - 1) / page * page;
+  void *region;
+  *tail = NULL;
+  *words = ((reachable < mmap_size ? reachable : mmap_size) - size) / sizeof(uint64_t);
+  if (!*words || size % sizeof(uint64_t))
+    return 0;
+  if (!(*tail = malloc(*words * sizeof(uint64_t))))
+    return -1;
+  region = mmap(NULL, reachable, PROT_READ, MAP_SHARED, fd, 0);
+  if (region == MAP_FAILED) {
+    free(*tail);
+    *tail = NULL;
+    return -1;
+  }
+  memcpy(*tail, (char *)region + size, *words * sizeof(uint64_t));
+  munmap(region, reachable);
+  return 0;
+}
+
+static bloomfilter_t *create_bloomfilter(int fd, uint64_t capacity, double error_rate, const bloomfilter_plan_t *plan) {
   bloomfilter_t *bloomfilter;
+  bloomfilter_plan_t stored;
+  uint64_t shape[3];
+  uint64_t *tail = NULL;
+  size_t tail_words = 0;
+  size_t i;
   char magicbuffer[25];
-  uint64_t i;
-  uint64_t zero=0;
 
   if (fd == 0) {
-    return create_private_bloomfilter(capacity, error_rate);
+    return create_private_bloomfilter(capacity, error_rate, plan);
   }
   struct stat stats;
   if (-1 == bloomfilter_probes(error_rate))
@@ -228,15 +500,10 @@ static bloomfilter_t *create_bloomfilter(int fd, uint64_t capacity, double error
     goto error;
   if (stats.st_size == 0) {
     bloomfilter->capacity = capacity;
-    bloomfilter->probes = bloomfilter_probes(error_rate);
-    bloomfilter->length = (bloomfilter_size(capacity, error_rate) + 63) / 64;
-    bloomfilter->divisor = compute_unsigned_magic_info(bloomfilter->length * 64, 64);
-    write(fd, HEADER, 24);
-    write(fd, &capacity, sizeof(uint64_t));
-    write(fd, &error_rate, sizeof(uint64_t));
-    write(fd, &capacity, sizeof(uint64_t));
-    for(i=0; i< bloomfilter->length; ++i)
-      write(fd, &zero, sizeof(uint64_t));
+    bloomfilter->error_rate = error_rate;
+    bloomfilter_shape(bloomfilter, plan);
+    if (bloomfilter_write_header(fd, capacity, error_rate, capacity, plan))
+      goto error;
   } else {
     lseek(fd, 0, 0);
     read(fd, magicbuffer, 24);
@@ -249,29 +516,44 @@ static bloomfilter_t *create_bloomfilter(int fd, uint64_t capacity, double error
     if (read(fd, &bloomfilter->error_rate, sizeof(double)) < sizeof(double)) 
       goto error;
 
-    bloomfilter->probes = bloomfilter_probes(bloomfilter->error_rate);
-    bloomfilter->length = (bloomfilter_size(bloomfilter->capacity, bloomfilter->error_rate) + 63) / 64;
-    bloomfilter->divisor = compute_unsigned_magic_info(bloomfilter->length * 64, 64);
+    if (pread(fd, shape, sizeof(shape), BLOOMFILTER_PLAN_OFFSET) != sizeof(shape))
+      memset(shape, 0, sizeof(shape));
+    if (shape[2] == BLOOMFILTER_LEGACY) {
+      bloomfilter_shape(bloomfilter, NULL);
+    } else {
+      if (!bloomfilter_plan_from_shape(&stored, shape[0], shape[1], shape[2]))
+        goto error;
+      bloomfilter_shape(bloomfilter, &stored);
+    }
 
   }
-  flock(fd, LOCK_UN);
-  bloomfilter->mmap_size = 24 + sizeof(double) + sizeof(uint64_t)*3 + bloomfilter->length * sizeof(uint64_t);
-  bloomfilter->mmap = mmap(NULL,
-                           bloomfilter->mmap_size,
-                           PROT_READ | PROT_WRITE,
-                           MAP_SHARED | MAP_HASSEMAPHORE,
-                           fd,
-                           0);
+  // Size the file to cover the whole bit array so every bit is backed by
+  // the file; older files stopped 56 bytes short of it.
+  bloomfilter->mmap_size = bloomfilter_bits_offset(bloomfilter->layout) + bloomfilter->length * sizeof(uint64_t);
+  if (stats.st_size && (size_t)stats.st_size < bloomfilter->mmap_size
+      && bloomfilter_save_tail(fd, stats.st_size, bloomfilter->mmap_size, &tail, &tail_words))
+    goto error;
+  if ((size_t)stats.st_size < bloomfilter->mmap_size && ftruncate(fd, bloomfilter->mmap_size))
+    goto error;
+  bloomfilter->mmap = map_shared_file(fd, bloomfilter->mmap_size);
   if (!bloomfilter->mmap) 
     goto error;
+  // Bits are only ever set between clears, so OR the saved tail back in
+  // to keep anything set since it was copied.
+  for (i = 0; i < tail_words; ++i)
+    if (tail[i])
+      __atomic_or_fetch((uint64_t *)((char *)bloomfilter->mmap + stats.st_size) + i, tail[i], __ATOMIC_RELAXED);
+  flock(fd, LOCK_UN);
+  free(tail);
 
-  madvise(bloomfilter->mmap, bloomfilter->mmap_size, MADV_RANDOM);
-  bloomfilter->counter = bloomfilter->mmap + 24 + sizeof(double) + sizeof(uint64_t);
-  bloomfilter->bits = bloomfilter->counter + sizeof(uint64_t);
+  bloomfilter->fd = fd;
+  bloomfilter->counter = bloomfilter->mmap + BLOOMFILTER_COUNTER_OFFSET;
+  bloomfilter->bits = bloomfilter->mmap + bloomfilter_bits_offset(bloomfilter->layout);
   return bloomfilter;
 
  error:
   flock(fd, LOCK_UN);
+  free(tail);
   if (bloomfilter) free(bloomfilter);
   return NULL;
 
@@ -292,50 +574,68 @@ static void peloton_shared_memory_bloomfilter_destroy(bloomfilter_t *bloomfilter
   free(bloomfilter);
 }
 
-static PyObject *
-peloton_bloomfilter_clear(SharedMemoryBloomfilterObject *smbo, PyObject *_) {
-  bloomfilter_t *bf = smbo->bf;
+static void bloomfilter_clear(bloomfilter_t *bf) {
   size_t length = bf->length;
   size_t i;
   uint64_t *data = __builtin_assume_aligned(bf->bits, 16);
   for(i=0; i<length; ++i)
     data[i] = 0;
   *bf->counter = bf->capacity;
-  Py_RETURN_NONE;
 }
 
+// Planned layouts mix the hash before the first probe; Python hashes of
+// small ints are the ints themselves and would otherwise fill the array
+// in order.  BLOCKED takes 9 bit offsets into the block from a hash,
+// seven at a time.
+#define BLOOMFILTER_BLOCK_PROBES_PER_HASH 7
 
-static PyObject *
-peloton_bloomfilter_add(SharedMemoryBloomfilterObject *smbo, PyObject *item) {
-  bloomfilter_t *bloomfilter = smbo->bf;
-  int probes = bloomfilter->probes;
-  size_t length = bloomfilter->length;
-  uint64_t hash = PyObject_Hash(item);
-  if (hash == (uint64_t)(-1))
-    return NULL;
+static inline uint64_t *bloomfilter_block(bloomfilter_t *bf, uint64_t hash) {
+  return bf->bits + magic_mod(hash, &bf->divisor, bf->size / BLOOMFILTER_BLOCK_BITS) * (BLOOMFILTER_BLOCK_BITS / 64);
+}
 
-  bloomfilter->counter -= 1;
-  uint64_t count = bloomfilter->counter;
-  uint64_t cleared = !count;
-  if (cleared || count > bloomfilter->capacity) {
-    Py_DECREF(peloton_bloomfilter_clear(smbo, NULL));
+// Sets the probe bits for hash with atomic ors; safe to call without the GIL.
+static inline void bloomfilter_set_bits(bloomfilter_t *bf, uint64_t hash) {
+  int probes = bf->probes;
+  size_t length = bf->length;
+  uint64_t *data = __builtin_assume_aligned(bf->bits, 16);
+  uint64_t offset;
+  int i;
+
+  if (bf->layout == BLOOMFILTER_STANDARD) {
+    while (probes--) {
+      hash = xxh64(hash);
+      offset = magic_mod(hash, &bf->divisor, bf->size);
+      __atomic_or_fetch(data + (offset >> 6), (uint64_t)1 << (offset & 0x3f), 1);
+    }
+    return;
   }
-  uint64_t *data = __builtin_assume_aligned(smbo->bf->bits, 16);
-  
+  if (bf->layout == BLOOMFILTER_BLOCKED) {
+    hash = xxh64(hash);
+    uint64_t *block = bloomfilter_block(bf, hash);
+    uint64_t offsets = 0;
+    for (i = 0; i < probes; ++i) {
+      if (!(i % BLOOMFILTER_BLOCK_PROBES_PER_HASH))
+        offsets = hash = xxh64(hash);
+      offset = offsets & (BLOOMFILTER_BLOCK_BITS - 1);
+      offsets >>= 9;
+      __atomic_or_fetch(block + (offset >> 6), (uint64_t)1 << (offset & 0x3f), 1);
+    }
+    return;
+  }
+
   #ifdef USE_MOD
   while (1) {
-    data[(hash >> 6 ) % length] |= 1 << (hash & 0x3f);
+    __atomic_or_fetch(data + (hash >> 6 ) % length, 1 << (hash & 0x3f), 1);
     if (!probes--) break;
     hash = xxh64(hash);
   }
   #endif
 
   #ifndef USE_MOD
-  uint64_t offset;
-  uint64_t multiplier = smbo->bf->divisor.multiplier;
-  uint64_t pre_shift = smbo->bf->divisor.pre_shift;
-  uint64_t post_shift = smbo->bf->divisor.post_shift;
-  uint64_t increment = smbo->bf->divisor.increment; 
+  uint64_t multiplier = bf->divisor.multiplier;
+  uint64_t pre_shift = bf->divisor.pre_shift;
+  uint64_t post_shift = bf->divisor.post_shift;
+  uint64_t increment = bf->divisor.increment; 
 
   while (probes--) {
     offset = hash;
@@ -345,16 +645,85 @@ peloton_bloomfilter_add(SharedMemoryBloomfilterObject *smbo, PyObject *item) {
       offset = (((__uint128_t)offset * (__uint128_t)multiplier)) >> 64;
     offset >>= post_shift;
     offset = hash - offset * length * 64;
-    data[offset >> 6] |= 1 << (hash & 0x3f);
+    __atomic_or_fetch(data + (offset >> 6), 1<<(hash & 0x3f), 1);
     hash = xxh64(hash);
   }
   #endif
-  return PyBool_FromLong(cleared);
+}
+
+static inline int bloomfilter_test_bits(bloomfilter_t *bf, uint64_t hash) {
+  uint64_t *data = __builtin_assume_aligned(bf->bits, 16);
+  int probes = bf->probes;
+  size_t length = bf->length;
+  uint64_t offset;
+  int i;
+
+  if (bf->layout == BLOOMFILTER_STANDARD) {
+    while (probes--) {
+      hash = xxh64(hash);
+      offset = magic_mod(hash, &bf->divisor, bf->size);
+      if (!(((uint64_t)1 << (offset & 0x3f)) & data[offset >> 6]))
+        return 0;
+    }
+    return 1;
+  }
+  if (bf->layout == BLOOMFILTER_BLOCKED) {
+    hash = xxh64(hash);
+    uint64_t *block = bloomfilter_block(bf, hash);
+    uint64_t offsets = 0;
+    for (i = 0; i < probes; ++i) {
+      if (!(i % BLOOMFILTER_BLOCK_PROBES_PER_HASH))
+        offsets = hash = xxh64(hash);
+      offset = offsets & (BLOOMFILTER_BLOCK_BITS - 1);
+      offsets >>= 9;
+      if (!(((uint64_t)1 << (offset & 0x3f)) & block[offset >> 6]))
+        return 0;
+    }
+    return 1;
+  }
+
+  #ifdef USE_MOD
+  while (1) {
+    if (!(1<<(hash & 0x3f) & *(data + (hash >> 6) % length)))
+      return 0;
+    if (!probes--)
+      return 1;
+    hash = xxh64(hash);
+  }
+  #endif
+
+  #ifndef USE_MOD
+
+  uint64_t multiplier = bf->divisor.multiplier;
+  uint64_t pre_shift = bf->divisor.pre_shift;
+  uint64_t post_shift = bf->divisor.post_shift;
+  uint64_t increment = bf->divisor.increment; 
+
+  while (probes--) {
+    offset = hash;
+    offset += increment;
+    offset >>= pre_shift;
+    if (multiplier != 1) 
+      offset = (((__uint128_t)offset * (__uint128_t)multiplier)) >> 64;
+    offset >>= post_shift;
+    offset = hash - offset * length * 64;
+    if (!(1<<(offset & 0x3f) & *(data + (offset >> 6))))
+      return 0;
+    hash = xxh64(hash);
+  }
+  return 1;
+  #endif
+}
+
+static PyObject *
+peloton_bloomfilter_clear(SharedMemoryBloomfilterObject *smbo, PyObject *_) {
+  bloomfilter_clear(smbo->bf);
+  Py_RETURN_NONE;
 }
 
 
 static PyObject *
-peloton_shared_memory_bloomfilter_add(SharedMemoryBloomfilterObject *smbo, PyObject *item) {
+peloton_bloomfilter_add(SharedMemoryBloomfilterObject *smbo, PyObject *item) {
   bloomfilter_t *bloomfilter = smbo->bf;
   int probes = bloomfilter->probes;
   size_t length = bloomfilter->length;
@@ -362,17 +731,17 @@ peloton_shared_memory_bloomfilter_add(SharedMemoryBloomfilterObject *smbo, PyObj
   if (hash == (uint64_t)(-1))
     return NULL;
 
-  uint64_t count=(__atomic_fetch_sub(bloomfilter->counter, (uint64_t)1, 0));
+  bloomfilter->counter -= 1;
+  uint64_t count = bloomfilter->counter;
   uint64_t cleared = !count;
   if (cleared || count > bloomfilter->capacity) {
     Py_DECREF(peloton_bloomfilter_clear(smbo, NULL));
   }
   uint64_t *data = __builtin_assume_aligned(smbo->bf->bits, 16);
-  Py_BEGIN_ALLOW_THREADS
   
   #ifdef USE_MOD
   while (1) {
-    __atomic_or_fetch(data + (hash >> 6 ) % length, 1 << (hash & 0x3f), 1);
+    data[(hash >> 6 ) % length] |= 1 << (hash & 0x3f);
     if (!probes--) break;
     hash = xxh64(hash);
   }
@@ -393,10 +762,28 @@ peloton_shared_memory_bloomfilter_add(SharedMemoryBloomfilterObject *smbo, PyObj
       offset = (((__uint128_t)offset * (__uint128_t)multiplier)) >> 64;
     offset >>= post_shift;
     offset = hash - offset * length * 64;
-    __atomic_or_fetch(data + (offset >> 6), 1<<(hash & 0x3f), 1);
+    data[offset >> 6] |= 1 << (hash & 0x3f);
     hash = xxh64(hash);
   }
   #endif
+  return PyBool_FromLong(cleared);
+}
+
+
+static PyObject *
+peloton_shared_memory_bloomfilter_add(SharedMemoryBloomfilterObject *smbo, PyObject *item) {
+  bloomfilter_t *bloomfilter = smbo->bf;
+  uint64_t hash = PyObject_Hash(item);
+  if (hash == (uint64_t)(-1))
+    return NULL;
+
+  uint64_t count=(__atomic_fetch_sub(bloomfilter->counter, (uint64_t)1, 0));
+  uint64_t cleared = !count;
+  if (cleared || count > bloomfilter->capacity) {
+    bloomfilter_clear(bloomfilter);
+  }
+  Py_BEGIN_ALLOW_THREADS
+  bloomfilter_set_bits(bloomfilter, hash);
   Py_END_ALLOW_THREADS
   return PyBool_FromLong(cleared);
 }
@@ -421,73 +808,414 @@ BloomFilterObject_len(SharedMemoryBloomfilterObject* smbo)
 int 
 BloomFilterObject_contains(SharedMemoryBloomfilterObject* smbo, PyObject *item)
 {
-  bloomfilter_t *bloomfilter = smbo->bf;
-  uint64_t *data = __builtin_assume_aligned(bloomfilter->bits, 16);
-  int probes = bloomfilter->probes;
-  size_t length = bloomfilter->length;
   uint64_t hash = PyObject_Hash(item);
   if (hash == (uint64_t)(-1)) {
     return -1;
   }
-    
-  #ifdef USE_MOD
-  while (1) {
-    if (!(1<<(hash & 0x3f) & *(data + (hash >> 6) % length)))
-      return 0;
-    if (!probes--)
-      return 1;
-    hash = xxh64(hash);
-  }
-  #endif
+  return bloomfilter_test_bits(smbo->bf, hash);
+}
 
-  #ifndef USE_MOD
 
+// Compressed snapshots.  The bit array is cut into blocks of 2^16 bits
+// and each block is stored as whichever container is smallest: nothing
+// for an empty block, a sorted array of set bit positions, a list of
+// runs of set bits, or the raw bitmap.  A delta snapshot stores the xor
+// against a base snapshot, which is sparse because bloomfilters only
+// gain bits between clears.
+//
+// Layout: SNAPSHOT_HEADER, capacity, error_rate, counter, length (words),
+// flags, base checksum, block count, a snapshot_plan_t for planned
+// filters, then one snapshot_block_t per block and the block payloads.
+
+const char SNAPSHOT_HEADER[] = "SharedMemory BF Snapshot";
+
+#define SNAPSHOT_BLOCK_WORDS 1024
+#define SNAPSHOT_BLOCK_BITS (SNAPSHOT_BLOCK_WORDS * 64)
+#define SNAPSHOT_DELTA 1
+#define SNAPSHOT_PLANNED 2
+
+enum {
+  SNAPSHOT_EMPTY = 0,
+  SNAPSHOT_ARRAY = 1,
+  SNAPSHOT_RUNS = 2,
+  SNAPSHOT_BITMAP = 3,
+};
+
+typedef struct {
+  char magic[24];
+  uint64_t capacity;
+  double error_rate;
+  uint64_t counter;
+  uint64_t length;
+  uint64_t flags;
+  uint64_t base_checksum;
+  uint64_t blocks;
+} snapshot_header_t;
+
+typedef struct {
+  uint64_t bits;
+  uint64_t probes;
+  uint64_t layout;
+} snapshot_plan_t;
+
+typedef struct {
   uint64_t offset;
-  uint64_t multiplier = smbo->bf->divisor.multiplier;
-  uint64_t pre_shift = smbo->bf->divisor.pre_shift;
-  uint64_t post_shift = smbo->bf->divisor.post_shift;
-  uint64_t increment = smbo->bf->divisor.increment; 
+  uint32_t type;
+  uint32_t size;
+} snapshot_block_t;
 
-  while (probes--) {
-    offset = hash;
-    offset += increment;
-    offset >>= pre_shift;
-    if (multiplier != 1) 
-      offset = (((__uint128_t)offset * (__uint128_t)multiplier)) >> 64;
-    offset >>= post_shift;
-    offset = hash - offset * smbo->bf->length * 64;
-    if (!(1<<(offset & 0x3f) & *(data + (offset >> 6))))
-      return 0;
-    hash = xxh64(hash);
+typedef struct {
+  void *map;
+  size_t size;
+  snapshot_header_t *header;
+  snapshot_plan_t *plan;
+  snapshot_block_t *directory;
+} snapshot_t;
+
+static uint64_t snapshot_checksum(const unsigned char *data, size_t size) {
+  uint64_t hash = size;
+  uint64_t word;
+  size_t i;
+  for (i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    memcpy(&word, data + i, sizeof(uint64_t));
+    hash = xxh64(hash ^ word);
   }
-  return 1;
-  #endif
+  for (; i < size; ++i)
+    hash = xxh64(hash ^ data[i]);
+  return hash;
+}
 
+static inline uint64_t snapshot_block_words(uint64_t length, uint64_t block) {
+  uint64_t start = block * SNAPSHOT_BLOCK_WORDS;
+  return length - start < SNAPSHOT_BLOCK_WORDS ? length - start : SNAPSHOT_BLOCK_WORDS;
 }
 
+// Encodes words into out, which must hold SNAPSHOT_BLOCK_WORDS words;
+// returns the container type and sets *size to the payload size.
+static uint32_t snapshot_encode_block(const uint64_t *words, uint64_t count, unsigned char *out, uint32_t *size) {
+  uint64_t cardinality = 0;
+  uint64_t runs = 0;
+  uint64_t carry = 0;
+  uint64_t i;
 
-static PySequenceMethods SharedMemoryBloomfilterObject_sequence_methods = {
-  BloomFilterObject_len, /* sq_length */
-  0,				/* sq_concat */
-  0,				/* sq_repeat */
-  0,				/* sq_item */
-  0,				/* sq_slice */
-  0,				/* sq_ass_item */
-  0,				/* sq_ass_slice */
-  (objobjproc)BloomFilterObject_contains,	/* sq_contains */
-};
+  for (i = 0; i < count; ++i) {
+    cardinality += __builtin_popcountll(words[i]);
+    runs += __builtin_popcountll(words[i] & ~((words[i] << 1) | carry));
+    carry = words[i] >> 63;
+  }
 
+  if (!cardinality) {
+    *size = 0;
+    return SNAPSHOT_EMPTY;
+  }
+  if (runs * 4 <= cardinality * 2 && runs * 4 < count * sizeof(uint64_t)) {
+    uint16_t *run = (uint16_t *)out;
+    uint64_t bit = 0;
+    uint64_t bits = count * 64;
+    while (bit < bits) {
+      if (!(words[bit >> 6] >> (bit & 0x3f) & 1)) {
+        bit++;
+        continue;
+      }
+      uint64_t start = bit;
+      while (bit < bits && (words[bit >> 6] >> (bit & 0x3f) & 1))
+        bit++;
+      *run++ = start;
+      *run++ = bit - start - 1;
+    }
+    *size = runs * 2 * sizeof(uint16_t);
+    return SNAPSHOT_RUNS;
+  }
+  if (cardinality * sizeof(uint16_t) < count * sizeof(uint64_t)) {
+    uint16_t *position = (uint16_t *)out;
+    for (i = 0; i < count; ++i) {
+      uint64_t word = words[i];
+      while (word) {
+        *position++ = i * 64 + __builtin_ctzll(word);
+        word &= word - 1;
+      }
+    }
+    *size = cardinality * sizeof(uint16_t);
+    return SNAPSHOT_ARRAY;
+  }
+  memcpy(out, words, count * sizeof(uint64_t));
+  *size = count * sizeof(uint64_t);
+  return SNAPSHOT_BITMAP;
+}
 
-static PyMethodDef peloton_shared_memory_bloomfilter_methods[] = {
-  {"add", (PyCFunction)peloton_shared_memory_bloomfilter_add, METH_O, NULL},
-  {"clear", (PyCFunction)peloton_bloomfilter_clear, METH_O, NULL},
-  {"population", (PyCFunction)peloton_bloomfilter_population, METH_NOARGS, NULL},
-  {NULL, NULL}
-};
+// Xors a block's payload into words; returns -1 if the payload is corrupt.
+static int snapshot_decode_block(snapshot_t *snapshot, uint64_t block, uint64_t *words) {
+  snapshot_block_t *entry = snapshot->directory + block;
+  uint64_t count = snapshot_block_words(snapshot->header->length, block);
+  uint64_t bits = count * 64;
+  const unsigned char *payload = (const unsigned char *)snapshot->map + entry->offset;
+  uint64_t i;
 
-static PyMethodDef peloton_bloomfilter_methods[] = {
-  {"add", (PyCFunction)peloton_bloomfilter_add, METH_O, NULL},
-  {"clear", (PyCFunction)peloton_bloomfilter_clear, METH_O, NULL},
+  if (entry->offset > snapshot->size || entry->size > snapshot->size - entry->offset)
+    return -1;
+  switch (entry->type) {
+  case SNAPSHOT_EMPTY:
+    return 0;
+  case SNAPSHOT_ARRAY:
+    for (i = 0; i < entry->size / sizeof(uint16_t); ++i) {
+      uint16_t position;
+      memcpy(&position, payload + i * sizeof(uint16_t), sizeof(uint16_t));
+      if (position >= bits)
+        return -1;
+      words[position >> 6] ^= (uint64_t)1 << (position & 0x3f);
+    }
+    return 0;
+  case SNAPSHOT_RUNS:
+    for (i = 0; i < entry->size / (2 * sizeof(uint16_t)); ++i) {
+      uint16_t run[2];
+      uint64_t bit, end;
+      memcpy(run, payload + i * 2 * sizeof(uint16_t), sizeof(run));
+      end = (uint64_t)run[0] + run[1] + 1;
+      if (end > bits)
+        return -1;
+      for (bit = run[0]; bit < end && (bit & 0x3f); ++bit)
+        words[bit >> 6] ^= (uint64_t)1 << (bit & 0x3f);
+      for (; bit + 64 <= end; bit += 64)
+        words[bit >> 6] ^= ~(uint64_t)0;
+      for (; bit < end; ++bit)
+        words[bit >> 6] ^= (uint64_t)1 << (bit & 0x3f);
+    }
+    return 0;
+  case SNAPSHOT_BITMAP:
+    if (entry->size != count * sizeof(uint64_t))
+      return -1;
+    for (i = 0; i < count; ++i) {
+      uint64_t word;
+      memcpy(&word, payload + i * sizeof(uint64_t), sizeof(uint64_t));
+      words[i] ^= word;
+    }
+    return 0;
+  }
+  return -1;
+}
+
+static void snapshot_close(snapshot_t *snapshot) {
+  if (snapshot->map)
+    munmap(snapshot->map, snapshot->size);
+  snapshot->map = NULL;
+}
+
+// Maps a snapshot read only and checks its header and directory; sets a
+// Python exception and returns -1 on failure.
+static int snapshot_open(snapshot_t *snapshot, const char *path) {
+  struct stat stats;
+  size_t directory;
+  int fd = open(path, O_RDONLY);
+  snapshot->map = NULL;
+  if (fd == -1 || fstat(fd, &stats)) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+  snapshot->size = stats.st_size;
+  if (snapshot->size < sizeof(snapshot_header_t)) {
+    close(fd);
+    PyErr_Format(PyExc_ValueError, "%s is not a bloomfilter snapshot", path);
+    return -1;
+  }
+  snapshot->map = mmap(NULL, snapshot->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (snapshot->map == MAP_FAILED) {
+    snapshot->map = NULL;
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+    return -1;
+  }
+  madvise(snapshot->map, snapshot->size, MADV_SEQUENTIAL);
+  snapshot->header = snapshot->map;
+  snapshot->plan = NULL;
+  directory = sizeof(snapshot_header_t);
+  if (snapshot->header->flags & SNAPSHOT_PLANNED) {
+    snapshot->plan = (snapshot_plan_t *)(snapshot->header + 1);
+    directory += sizeof(snapshot_plan_t);
+  }
+  snapshot->directory = (snapshot_block_t *)((char *)snapshot->map + directory);
+  if (strncmp(snapshot->header->magic, SNAPSHOT_HEADER, 24)
+      || directory > snapshot->size
+      || snapshot->header->blocks != (snapshot->header->length + SNAPSHOT_BLOCK_WORDS - 1) / SNAPSHOT_BLOCK_WORDS
+      || snapshot->header->blocks > (snapshot->size - directory) / sizeof(snapshot_block_t)) {
+    snapshot_close(snapshot);
+    PyErr_Format(PyExc_ValueError, "%s is not a bloomfilter snapshot", path);
+    return -1;
+  }
+  return 0;
+}
+
+static int snapshot_matches(snapshot_t *snapshot, snapshot_t *base) {
+  return snapshot->header->capacity == base->header->capacity
+    && snapshot->header->error_rate == base->header->error_rate
+    && snapshot->header->length == base->header->length
+    && !snapshot->plan == !base->plan
+    && (!snapshot->plan || !memcmp(snapshot->plan, base->plan, sizeof(snapshot_plan_t)));
+}
+
+static PyObject *
+peloton_bloomfilter_export_snapshot(SharedMemoryBloomfilterObject *smbo, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"path", "base", NULL};
+  bloomfilter_t *bf = smbo->bf;
+  char *path = NULL;
+  char *base_path = NULL;
+  char *tmp = NULL;
+  snapshot_t base = {NULL};
+  snapshot_t current;
+  snapshot_header_t header;
+  snapshot_plan_t plan = {bf->size, bf->probes, bf->layout};
+  snapshot_block_t *directory = NULL;
+  uint64_t *scratch = NULL;
+  unsigned char *out = NULL;
+  FILE *file = NULL;
+  uint64_t block;
+  uint64_t offset;
+  size_t directory_offset = sizeof(header);
+  mode_t mask;
+  int failed = 0;
+  int error = 0;
+  int fd;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|z", kwlist, &path, &base_path))
+    return NULL;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_HEADER, 24);
+  header.capacity = bf->capacity;
+  header.error_rate = bf->error_rate;
+  header.counter = *bf->counter;
+  header.length = bf->length;
+  header.blocks = (bf->length + SNAPSHOT_BLOCK_WORDS - 1) / SNAPSHOT_BLOCK_WORDS;
+  if (bf->layout != BLOOMFILTER_LEGACY) {
+    header.flags |= SNAPSHOT_PLANNED;
+    directory_offset += sizeof(plan);
+  }
+  current.header = &header;
+  current.plan = bf->layout != BLOOMFILTER_LEGACY ? &plan : NULL;
+
+  if (base_path) {
+    if (snapshot_open(&base, base_path))
+      return NULL;
+    // Deltas apply to a full snapshot only; import rejects delta bases.
+    if (base.header->flags & SNAPSHOT_DELTA) {
+      snapshot_close(&base);
+      PyErr_Format(PyExc_ValueError, "%s is a delta snapshot and cannot be a base", base_path);
+      return NULL;
+    }
+    if (!snapshot_matches(&current, &base)) {
+      snapshot_close(&base);
+      PyErr_Format(PyExc_ValueError, "%s is a snapshot of a different bloomfilter", base_path);
+      return NULL;
+    }
+    header.flags |= SNAPSHOT_DELTA;
+    header.base_checksum = snapshot_checksum(base.map, base.size);
+  }
+
+  if (!(directory = calloc(header.blocks, sizeof(snapshot_block_t)))
+      || !(scratch = malloc(SNAPSHOT_BLOCK_WORDS * sizeof(uint64_t)))
+      || !(out = malloc(SNAPSHOT_BLOCK_WORDS * sizeof(uint64_t)))
+      || !(tmp = malloc(strlen(path) + 8))) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  // A unique temporary file next to path keeps concurrent exports to the
+  // same path apart.  mkstemp creates it 0600, so give it the permissions
+  // fopen would have.
+  sprintf(tmp, "%s.XXXXXX", path);
+  mask = umask(0);
+  umask(mask);
+
+  Py_BEGIN_ALLOW_THREADS
+  fd = mkstemp(tmp);
+  failed = fd == -1
+    || fchmod(fd, 0666 & ~mask)
+    || !(file = fdopen(fd, "wb"))
+    || fwrite(&header, sizeof(header), 1, file) != 1
+    || (current.plan && fwrite(&plan, sizeof(plan), 1, file) != 1)
+    || fwrite(directory, sizeof(snapshot_block_t), header.blocks, file) != header.blocks;
+  offset = directory_offset + header.blocks * sizeof(snapshot_block_t);
+  for (block = 0; !failed && block < header.blocks; ++block) {
+    uint64_t count = snapshot_block_words(bf->length, block);
+    uint64_t *words = bf->bits + block * SNAPSHOT_BLOCK_WORDS;
+    if (base.map) {
+      memcpy(scratch, words, count * sizeof(uint64_t));
+      if (snapshot_decode_block(&base, block, scratch)) {
+        errno = EINVAL;
+        failed = 1;
+        break;
+      }
+      words = scratch;
+    }
+    directory[block].offset = offset;
+    directory[block].type = snapshot_encode_block(words, count, out, &directory[block].size);
+    if (directory[block].size && fwrite(out, directory[block].size, 1, file) != 1)
+      failed = 1;
+    offset += directory[block].size;
+  }
+  failed = failed
+    || fseek(file, directory_offset, SEEK_SET)
+    || fwrite(directory, sizeof(snapshot_block_t), header.blocks, file) != header.blocks
+    || fflush(file)
+    || fsync(fileno(file));
+  // Keep the errno of the first failure through the cleanup below.
+  error = errno;
+  if (file) {
+    if (fclose(file) && !failed) {
+      failed = 1;
+      error = errno;
+    }
+  } else if (fd != -1) {
+    close(fd);
+  }
+  if (!failed && rename(tmp, path)) {
+    failed = 1;
+    error = errno;
+  }
+  if (failed && fd != -1)
+    unlink(tmp);
+  Py_END_ALLOW_THREADS
+
+  if (failed) {
+    errno = error;
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+  }
+
+ done:
+  snapshot_close(&base);
+  free(directory);
+  free(scratch);
+  free(out);
+  free(tmp);
+  if (PyErr_Occurred())
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+
+static PySequenceMethods SharedMemoryBloomfilterObject_sequence_methods = {
+  BloomFilterObject_len, /* sq_length */
+  0,				/* sq_concat */
+  0,				/* sq_repeat */
+  0,				/* sq_item */
+  0,				/* sq_slice */
+  0,				/* sq_ass_item */
+  0,				/* sq_ass_slice */
+  (objobjproc)BloomFilterObject_contains,	/* sq_contains */
+};
+
+
+static PyMethodDef peloton_shared_memory_bloomfilter_methods[] = {
+  {"add", (PyCFunction)peloton_shared_memory_bloomfilter_add, METH_O, NULL},
+  {"clear", (PyCFunction)peloton_bloomfilter_clear, METH_O, NULL},
+  {"population", (PyCFunction)peloton_bloomfilter_population, METH_NOARGS, NULL},
+  {"export_snapshot", (PyCFunction)peloton_bloomfilter_export_snapshot, METH_VARARGS | METH_KEYWORDS, "export_snapshot(path, base=None): write a compressed snapshot, as a delta against base if given"},
+  {NULL, NULL}
+};
+
+static PyMethodDef peloton_bloomfilter_methods[] = {
+  {"add", (PyCFunction)peloton_bloomfilter_add, METH_O, NULL},
+  {"clear", (PyCFunction)peloton_bloomfilter_clear, METH_O, NULL},
   {"population", (PyCFunction)peloton_bloomfilter_population, METH_NOARGS, NULL},
   {NULL, NULL}
 };
@@ -507,7 +1235,123 @@ static void peloton_shared_memory_bloomfilter_type_dealloc(SharedMemoryBloomfilt
 }
 
 PyObject *
-make_new_peloton_bloomfilter(PyTypeObject *type, int fd, uint64_t capacity, double error_rate);
+make_new_peloton_bloomfilter(PyTypeObject *type, int fd, uint64_t capacity, double error_rate, const bloomfilter_plan_t *plan);
+
+static const char *bloomfilter_layout_names[] = {"legacy", "standard", "blocked"};
+
+static int bloomfilter_layout_from_name(const char *name) {
+  int layout;
+  for (layout = BLOOMFILTER_STANDARD; layout <= BLOOMFILTER_BLOCKED; ++layout)
+    if (!strcmp(name, bloomfilter_layout_names[layout]))
+      return layout;
+  PyErr_Format(PyExc_ValueError, "unknown layout %s", name);
+  return -1;
+}
+
+static PyObject *bloomfilter_plan_to_object(const bloomfilter_plan_t *plan) {
+  return Py_BuildValue("{s:k,s:d,s:k,s:i,s:s,s:d}",
+                       "capacity", (unsigned long)plan->capacity,
+                       "error_rate", plan->error_rate,
+                       "bits", (unsigned long)plan->bits,
+                       "probes", plan->probes,
+                       "layout", bloomfilter_layout_names[plan->layout],
+                       "predicted_error_rate", plan->predicted_error_rate);
+}
+
+static int bloomfilter_plan_field(PyObject *dict, const char *key, PyObject **value) {
+  if (!(*value = PyDict_GetItemString(dict, key))) {
+    PyErr_Format(PyExc_ValueError, "plan has no %s", key);
+    return -1;
+  }
+  return 0;
+}
+
+// Reads a plan() result.  Returns 1 if obj is a plan, 0 for None and -1
+// with an exception set otherwise.
+// Values too large for a long long become -1 and so fail validation as
+// an invalid plan instead of wrapping into a small, valid looking one.
+static int bloomfilter_plan_integer(PyObject *value, PY_LONG_LONG *result) {
+  *result = PyLong_AsLongLong(value);
+  if (*result == -1 && PyErr_Occurred()) {
+    if (!PyErr_ExceptionMatches(PyExc_OverflowError))
+      return -1;
+    PyErr_Clear();
+  }
+  return 0;
+}
+
+static int bloomfilter_plan_from_object(PyObject *obj, bloomfilter_plan_t *plan) {
+  PyObject *value;
+  PY_LONG_LONG bits;
+  PY_LONG_LONG probes;
+  if (!obj || obj == Py_None)
+    return 0;
+  if (!PyDict_Check(obj)) {
+    PyErr_SetString(PyExc_TypeError, "plan must be a dict returned by plan()");
+    return -1;
+  }
+  if (bloomfilter_plan_field(obj, "capacity", &value))
+    return -1;
+  plan->capacity = PyInt_AsUnsignedLongMask(value);
+  if (bloomfilter_plan_field(obj, "error_rate", &value))
+    return -1;
+  plan->error_rate = PyFloat_AsDouble(value);
+  if (bloomfilter_plan_field(obj, "bits", &value))
+    return -1;
+  if (bloomfilter_plan_integer(value, &bits))
+    return -1;
+  if (bloomfilter_plan_field(obj, "probes", &value))
+    return -1;
+  if (bloomfilter_plan_integer(value, &probes))
+    return -1;
+  if (bloomfilter_plan_field(obj, "layout", &value))
+    return -1;
+  if (!PyString_Check(value)) {
+    PyErr_SetString(PyExc_TypeError, "plan layout must be a string");
+    return -1;
+  }
+  if ((plan->layout = bloomfilter_layout_from_name(PyString_AS_STRING(value))) == -1)
+    return -1;
+  if (PyErr_Occurred())
+    return -1;
+  if (!plan->capacity || -1 == bloomfilter_probes(plan->error_rate) || bits < 0 || probes < 0
+      || !bloomfilter_plan_from_shape(plan, bits, probes, plan->layout)) {
+    PyErr_SetString(PyExc_ValueError, "invalid plan");
+    return -1;
+  }
+  plan->predicted_error_rate = bloomfilter_plan_error_rate(plan->capacity, plan->bits, plan->probes, plan->layout);
+  return 1;
+}
+
+static PyObject *
+peloton_bloomfilter_plan(PyObject *self, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"capacity", "error_rate", "objective", "layout", NULL};
+  uint64_t capacity;
+  double error_rate;
+  char *objective = "memory";
+  char *layout_name = "standard";
+  bloomfilter_plan_t plan;
+  int layout;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "kd|ss", kwlist, &capacity, &error_rate, &objective, &layout_name))
+    return NULL;
+  if (strcmp(objective, "memory") && strcmp(objective, "latency")) {
+    PyErr_Format(PyExc_ValueError, "objective must be 'memory' or 'latency', not %s", objective);
+    return NULL;
+  }
+  if ((layout = bloomfilter_layout_from_name(layout_name)) == -1)
+    return NULL;
+  if ((error_rate <= 0) || (error_rate >= 1) || !capacity) {
+    PyErr_SetString(PyExc_ValueError, "capacity must be positive and error_rate between 0 and 1");
+    return NULL;
+  }
+  if (bloomfilter_plan(&plan, capacity, error_rate, !strcmp(objective, "latency"), layout)) {
+    PyErr_Format(PyExc_ValueError, "no filter of at most %llu bits meets this capacity and error_rate",
+                 (unsigned long long)BLOOMFILTER_MAX_BITS);
+    return NULL;
+  }
+  return bloomfilter_plan_to_object(&plan);
+}
 
 
 static int 
@@ -565,21 +1409,32 @@ peloton_shared_memory_bloomfilter_new(PyTypeObject *type, PyObject *args, PyObje
   char *path = NULL;
   uint64_t capacity = 1000;
   double error_rate = 1.0 / 128.0;
-  static char *kwlist[] = {"file", "capacity", "error_rate", NULL};
-
-  PyArg_ParseTupleAndKeywords(args,
-			      kwargs,
-			      "s|ld",
-			      kwlist,
-			      &path,
-			      &capacity,
-			      &error_rate);
+  PyObject *plan_object = NULL;
+  bloomfilter_plan_t plan;
+  int planned;
+  static char *kwlist[] = {"file", "capacity", "error_rate", "plan", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args,
+                                   kwargs,
+                                   "s|ldO",
+                                   kwlist,
+                                   &path,
+                                   &capacity,
+                                   &error_rate,
+                                   &plan_object))
+    return NULL;
+  if ((planned = bloomfilter_plan_from_object(plan_object, &plan)) == -1)
+    return NULL;
+  if (planned) {
+    capacity = plan.capacity;
+    error_rate = plan.error_rate;
+  }
 
   fd = open(path, O_CREAT|O_RDWR, ~0);
   if (fd == -1) {
     return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
   }
-  PyObject *smbo = make_new_peloton_bloomfilter(type, fd, capacity, error_rate);
+  PyObject *smbo = make_new_peloton_bloomfilter(type, fd, capacity, error_rate, planned ? &plan : NULL);
   if (!smbo)
     {
     return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
@@ -589,18 +1444,32 @@ peloton_shared_memory_bloomfilter_new(PyTypeObject *type, PyObject *args, PyObje
 
 static PyObject *
 peloton_bloomfilter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
-  static char *kwlist[] = {"capacity", "error_rate", NULL};
+  static char *kwlist[] = {"capacity", "error_rate", "plan", NULL};
+
+  uint64_t capacity = 0;
+  double error_rate = 0;
+  PyObject *plan_object = NULL;
+  bloomfilter_plan_t plan;
+  int planned;
+  if (!PyArg_ParseTupleAndKeywords(args,
+                                   kwargs,
+                                   "|ldO",
+                                   kwlist,
+                                   &capacity,
+                                   &error_rate,
+                                   &plan_object))
+    return NULL;
+  if ((planned = bloomfilter_plan_from_object(plan_object, &plan)) == -1)
+    return NULL;
+  if (planned) {
+    capacity = plan.capacity;
+    error_rate = plan.error_rate;
+  } else if (!capacity || -1 == bloomfilter_probes(error_rate)) {
+    PyErr_SetString(PyExc_ValueError, "capacity and error_rate, or a plan, are required");
+    return NULL;
+  }
 
-  uint64_t capacity;
-  double error_rate;
-  PyArg_ParseTupleAndKeywords(args,
-			      kwargs,
-			      "ld",
-			      kwlist,
-			      &capacity,
-			      &error_rate);
-
-  BloomfilterObject *obj = make_new_peloton_bloomfilter(type, NULL, capacity, error_rate);
+  BloomfilterObject *obj = make_new_peloton_bloomfilter(type, NULL, capacity, error_rate, planned ? &plan : NULL);
   if (!obj)
     PyErr_NoMemory();
   return (PyObject *)obj;
@@ -734,20 +1603,1632 @@ PyTypeObject BloomfilterType = {
 
 
 PyObject *
-make_new_peloton_bloomfilter(PyTypeObject *type, int fd, uint64_t capacity, double error_rate) {
+make_new_peloton_bloomfilter(PyTypeObject *type, int fd, uint64_t capacity, double error_rate, const bloomfilter_plan_t *plan) {
   SharedMemoryBloomfilterObject *smbo = PyObject_GC_New(SharedMemoryBloomfilterObject, &SharedMemoryBloomfilterType);;
   
   if (!smbo)
     return NULL;
-  if (!(smbo->bf= create_bloomfilter(fd, capacity, error_rate))) {
+  if (!(smbo->bf= create_bloomfilter(fd, capacity, error_rate, plan))) {
     return NULL;
   }
   return smbo;
 }
 
 
+// Bit-sliced multi-filter.  Every member shares the same capacity,
+// error rate and therefore probe positions; member i owns bit i of each
+// row.  A lookup ANDs the k probed rows together and whatever survives is
+// the set of members that may contain the item.
+
+const char MULTI_HEADER[] = "SharedMemory MultiFilter";
+
+// Magic, capacity, error_rate, filters, then the bits/probes/layout words
+// of a planned shape (all zero for the legacy shape).
+#define MULTI_HEADER_SIZE (24 + sizeof(uint64_t) * 5 + sizeof(double))
+#define MULTI_ALIGN 64
+// Caps the counter block at 128MB and a row at 2MB.
+#define MULTI_MAX_FILTERS ((uint64_t)1 << 24)
+
+typedef uint64_t row_vector_t __attribute__((vector_size(32)));
+
+static inline uint64_t multi_bloomfilter_row(multi_bloomfilter_t *mbf, uint64_t hash) {
+  return magic_mod(hash, &mbf->divisor, mbf->length);
+}
+
+static uint64_t multi_bloomfilter_row_words(uint64_t filters) {
+  // Rows up to a cache line are padded to a power of two so no row
+  // straddles two lines; wider rows are padded to whole cache lines so
+  // the AND loop can run on aligned vectors.
+  uint64_t words = (filters + 63) / 64;
+  uint64_t padded = 1;
+  if (words > MULTI_ALIGN / sizeof(uint64_t))
+    return (words + 7) & ~(uint64_t)7;
+  while (padded < words)
+    padded <<= 1;
+  return padded;
+}
+
+// Planned multi-filters have one row per planned bit and mix the first
+// probe like planned bloomfilters; only the standard layout applies since
+// a row is already a probe's worth of memory.
+static int multi_bloomfilter_layout(multi_bloomfilter_t *mbf, const bloomfilter_plan_t *plan) {
+  size_t rows_offset = MULTI_HEADER_SIZE + mbf->filters * sizeof(uint64_t);
+  rows_offset = (rows_offset + MULTI_ALIGN - 1) & ~(size_t)(MULTI_ALIGN - 1);
+  if (plan) {
+    mbf->probes = plan->probes;
+    mbf->length = plan->bits;
+    mbf->layout = plan->layout;
+  } else {
+    mbf->probes = bloomfilter_probes(mbf->error_rate);
+    mbf->length = bloomfilter_size(mbf->capacity, mbf->error_rate);
+    mbf->layout = BLOOMFILTER_LEGACY;
+  }
+  mbf->row_words = multi_bloomfilter_row_words(mbf->filters);
+  if (mbf->length > (SIZE_MAX - rows_offset) / (mbf->row_words * sizeof(uint64_t)))
+    return -1;
+  mbf->divisor = compute_unsigned_magic_info(mbf->length, 64);
+  mbf->mmap_size = rows_offset + mbf->length * mbf->row_words * sizeof(uint64_t);
+  return 0;
+}
+
+static void peloton_multi_bloomfilter_destroy(multi_bloomfilter_t *mbf) {
+  if (mbf->mmap)
+    munmap(mbf->mmap, mbf->mmap_size);
+  if (mbf->fd)
+    close(mbf->fd);
+  free(mbf->scratch);
+  free(mbf);
+}
+
+static multi_bloomfilter_t *create_multi_bloomfilter(int fd, uint64_t filters, uint64_t capacity, double error_rate,
+                                                     const bloomfilter_plan_t *plan) {
+  multi_bloomfilter_t *mbf;
+  bloomfilter_plan_t stored;
+  char magicbuffer[24];
+  struct stat stats;
+  uint64_t shape[3] = {0, 0, 0};
+  uint64_t *counters;
+  ssize_t written;
+  uint64_t i;
+
+  if (-1 == bloomfilter_probes(error_rate) || !filters || filters > MULTI_MAX_FILTERS || !capacity
+      || (plan && plan->layout != BLOOMFILTER_STANDARD)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (!(mbf = calloc(1, sizeof(multi_bloomfilter_t))))
+    return NULL;
+  flock(fd, LOCK_EX);
+
+  if (fstat(fd, &stats))
+    goto error;
+  if (stats.st_size == 0) {
+    mbf->capacity = capacity;
+    mbf->error_rate = error_rate;
+    mbf->filters = filters;
+    if (multi_bloomfilter_layout(mbf, plan))
+      goto invalid;
+    if (plan) {
+      shape[0] = plan->bits;
+      shape[1] = plan->probes;
+      shape[2] = plan->layout;
+    }
+    if (write(fd, MULTI_HEADER, 24) != 24
+        || write(fd, &capacity, sizeof(uint64_t)) != sizeof(uint64_t)
+        || write(fd, &error_rate, sizeof(double)) != sizeof(double)
+        || write(fd, &filters, sizeof(uint64_t)) != sizeof(uint64_t)
+        || write(fd, shape, sizeof(shape)) != sizeof(shape))
+      goto error;
+    if (!(counters = malloc(filters * sizeof(uint64_t))))
+      goto error;
+    for (i = 0; i < filters; ++i)
+      counters[i] = capacity;
+    written = write(fd, counters, filters * sizeof(uint64_t));
+    free(counters);
+    if (written != (ssize_t)(filters * sizeof(uint64_t)))
+      goto error;
+    if (ftruncate(fd, mbf->mmap_size))
+      goto error;
+  } else {
+    lseek(fd, 0, 0);
+    if (read(fd, magicbuffer, 24) != 24 || strncmp(magicbuffer, MULTI_HEADER, 24))
+      goto invalid;
+    if (read(fd, &mbf->capacity, sizeof(uint64_t)) != sizeof(uint64_t))
+      goto invalid;
+    if (read(fd, &mbf->error_rate, sizeof(double)) != sizeof(double))
+      goto invalid;
+    if (read(fd, &mbf->filters, sizeof(uint64_t)) != sizeof(uint64_t))
+      goto invalid;
+    if (read(fd, shape, sizeof(shape)) != sizeof(shape))
+      goto invalid;
+    if (-1 == bloomfilter_probes(mbf->error_rate) || !mbf->filters || mbf->filters > MULTI_MAX_FILTERS
+        || !mbf->capacity)
+      goto invalid;
+    if (shape[2] != BLOOMFILTER_LEGACY
+        && (shape[2] != BLOOMFILTER_STANDARD || !bloomfilter_plan_from_shape(&stored, shape[0], shape[1], shape[2])))
+      goto invalid;
+    if (multi_bloomfilter_layout(mbf, shape[2] == BLOOMFILTER_LEGACY ? NULL : &stored)
+        || (size_t)stats.st_size < mbf->mmap_size)
+      goto invalid;
+  }
+  flock(fd, LOCK_UN);
+
+  if (posix_memalign((void **)&mbf->scratch, MULTI_ALIGN, mbf->row_words * sizeof(uint64_t)))
+    goto error_unlocked;
+  if (!(mbf->mmap = map_shared_file(fd, mbf->mmap_size)))
+    goto error_unlocked;
+  mbf->fd = fd;
+  mbf->counters = mbf->mmap + MULTI_HEADER_SIZE;
+  mbf->rows = mbf->mmap + mbf->mmap_size - mbf->length * mbf->row_words * sizeof(uint64_t);
+  return mbf;
+
+ invalid:
+  errno = EINVAL;
+ error:
+  flock(fd, LOCK_UN);
+ error_unlocked:
+  free(mbf->scratch);
+  free(mbf);
+  return NULL;
+}
+
+static void multi_bloomfilter_clear_member(multi_bloomfilter_t *mbf, uint64_t filter) {
+  uint64_t row_words = mbf->row_words;
+  uint64_t *column = mbf->rows + filter / 64;
+  uint64_t mask = ~((uint64_t)1 << (filter & 0x3f));
+  uint64_t i;
+  for (i = 0; i < mbf->length; ++i)
+    if (column[i * row_words] & ~mask)
+      __sync_and_and_fetch(column + i * row_words, mask);
+}
+
+static int
+multi_bloomfilter_member(multi_bloomfilter_t *mbf, PyObject *arg, uint64_t *filter) {
+  long value = PyInt_AsLong(arg);
+  if (value == -1 && PyErr_Occurred())
+    return -1;
+  if (value < 0 || (uint64_t)value >= mbf->filters) {
+    PyErr_Format(PyExc_IndexError, "filter %ld out of range", value);
+    return -1;
+  }
+  *filter = value;
+  return 0;
+}
+
+static PyObject *
+peloton_multi_bloomfilter_add(SharedMemoryMultiBloomfilterObject *self, PyObject *args) {
+  multi_bloomfilter_t *mbf = self->mbf;
+  PyObject *member;
+  PyObject *item;
+  uint64_t filter;
+  if (!PyArg_ParseTuple(args, "OO", &member, &item))
+    return NULL;
+  if (multi_bloomfilter_member(mbf, member, &filter))
+    return NULL;
+  uint64_t hash = PyObject_Hash(item);
+  if (hash == (uint64_t)(-1))
+    return NULL;
+
+  int probes = mbf->probes;
+  uint64_t row_words = mbf->row_words;
+  uint64_t *column = mbf->rows + filter / 64;
+  uint64_t bit = (uint64_t)1 << (filter & 0x3f);
+  uint64_t count = __atomic_fetch_sub(mbf->counters + filter, (uint64_t)1, 0);
+  uint64_t cleared = !count;
+
+  Py_BEGIN_ALLOW_THREADS
+  if (cleared || count > mbf->capacity) {
+    multi_bloomfilter_clear_member(mbf, filter);
+    mbf->counters[filter] = mbf->capacity - 1;
+  }
+  if (mbf->layout != BLOOMFILTER_LEGACY)
+    hash = xxh64(hash);
+  while (probes--) {
+    __atomic_or_fetch(column + multi_bloomfilter_row(mbf, hash) * row_words, bit, 1);
+    hash = xxh64(hash);
+  }
+  Py_END_ALLOW_THREADS
+  return PyBool_FromLong(cleared);
+}
+
+// ANDs the probed rows into mbf->scratch; returns 0 as soon as no member
+// can match so absent items usually cost a single row.
+static int multi_bloomfilter_match(multi_bloomfilter_t *mbf, uint64_t hash) {
+  int probes = mbf->probes;
+  uint64_t row_words = mbf->row_words;
+  uint64_t *acc = __builtin_assume_aligned(mbf->scratch, MULTI_ALIGN);
+  uint64_t any;
+  uint64_t i;
+
+  if (mbf->layout != BLOOMFILTER_LEGACY)
+    hash = xxh64(hash);
+  memcpy(acc, mbf->rows + multi_bloomfilter_row(mbf, hash) * row_words, row_words * sizeof(uint64_t));
+  while (--probes > 0) {
+    hash = xxh64(hash);
+    uint64_t *row = mbf->rows + multi_bloomfilter_row(mbf, hash) * row_words;
+    any = 0;
+    if (row_words >= MULTI_ALIGN / sizeof(uint64_t)) {
+      row_vector_t *vacc = (row_vector_t *)acc;
+      row_vector_t *vrow = (row_vector_t *)__builtin_assume_aligned(row, MULTI_ALIGN);
+      row_vector_t vany = {0, 0, 0, 0};
+      for (i = 0; i < row_words / 4; ++i) {
+        vacc[i] &= vrow[i];
+        vany |= vacc[i];
+      }
+      any = vany[0] | vany[1] | vany[2] | vany[3];
+    } else {
+      for (i = 0; i < row_words; ++i) {
+        acc[i] &= row[i];
+        any |= acc[i];
+      }
+    }
+    if (!any)
+      return 0;
+  }
+  if (mbf->probes > 1)
+    return 1;
+  for (i = 0; i < row_words; ++i)
+    if (acc[i])
+      return 1;
+  return 0;
+}
+
+static PyObject *
+peloton_multi_bloomfilter_lookup(SharedMemoryMultiBloomfilterObject *self, PyObject *item) {
+  multi_bloomfilter_t *mbf = self->mbf;
+  uint64_t hash = PyObject_Hash(item);
+  if (hash == (uint64_t)(-1))
+    return NULL;
+  if (!multi_bloomfilter_match(mbf, hash))
+    return PyInt_FromLong(0);
+  return _PyLong_FromByteArray((unsigned char *)mbf->scratch,
+                               mbf->row_words * sizeof(uint64_t),
+                               1,
+                               0);
+}
+
+static int
+SharedMemoryMultiBloomfilterObject_contains(SharedMemoryMultiBloomfilterObject *self, PyObject *item) {
+  uint64_t hash = PyObject_Hash(item);
+  if (hash == (uint64_t)(-1))
+    return -1;
+  return multi_bloomfilter_match(self->mbf, hash);
+}
+
+static PyObject *
+peloton_multi_bloomfilter_clear(SharedMemoryMultiBloomfilterObject *self, PyObject *args) {
+  multi_bloomfilter_t *mbf = self->mbf;
+  PyObject *member = NULL;
+  uint64_t filter;
+  uint64_t i;
+  if (!PyArg_ParseTuple(args, "|O", &member))
+    return NULL;
+  if (!member) {
+    memset(mbf->rows, 0, mbf->length * mbf->row_words * sizeof(uint64_t));
+    for (i = 0; i < mbf->filters; ++i)
+      mbf->counters[i] = mbf->capacity;
+    Py_RETURN_NONE;
+  }
+  if (multi_bloomfilter_member(mbf, member, &filter))
+    return NULL;
+  multi_bloomfilter_clear_member(mbf, filter);
+  mbf->counters[filter] = mbf->capacity;
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+peloton_multi_bloomfilter_count(SharedMemoryMultiBloomfilterObject *self, PyObject *member) {
+  multi_bloomfilter_t *mbf = self->mbf;
+  uint64_t filter;
+  if (multi_bloomfilter_member(mbf, member, &filter))
+    return NULL;
+  return PyInt_FromSize_t(mbf->capacity - mbf->counters[filter]);
+}
+
+static Py_ssize_t
+SharedMemoryMultiBloomfilterObject_len(SharedMemoryMultiBloomfilterObject *self) {
+  return self->mbf->filters;
+}
+
+static PySequenceMethods SharedMemoryMultiBloomfilterObject_sequence_methods = {
+  (lenfunc)SharedMemoryMultiBloomfilterObject_len, /* sq_length */
+  0,				/* sq_concat */
+  0,				/* sq_repeat */
+  0,				/* sq_item */
+  0,				/* sq_slice */
+  0,				/* sq_ass_item */
+  0,				/* sq_ass_slice */
+  (objobjproc)SharedMemoryMultiBloomfilterObject_contains,	/* sq_contains */
+};
+
+static PyMethodDef peloton_multi_bloomfilter_methods[] = {
+  {"add", (PyCFunction)peloton_multi_bloomfilter_add, METH_VARARGS, "add(filter, item): add item to one member filter"},
+  {"lookup", (PyCFunction)peloton_multi_bloomfilter_lookup, METH_O, "lookup(item): bitmap of the member filters that may hold item"},
+  {"clear", (PyCFunction)peloton_multi_bloomfilter_clear, METH_VARARGS, "clear([filter]): clear one member filter, or all of them"},
+  {"count", (PyCFunction)peloton_multi_bloomfilter_count, METH_O, "count(filter): items added to a member filter since it was cleared"},
+  {NULL, NULL}
+};
+
+static void peloton_multi_bloomfilter_type_dealloc(SharedMemoryMultiBloomfilterObject *self) {
+  if (self->mbf)
+    peloton_multi_bloomfilter_destroy(self->mbf);
+  PyObject_Del(self);
+}
+
+static PyObject *
+peloton_multi_bloomfilter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+  int fd;
+  char *path = NULL;
+  uint64_t filters;
+  uint64_t capacity = 1000;
+  double error_rate = 1.0 / 128.0;
+  PyObject *plan_object = NULL;
+  bloomfilter_plan_t plan;
+  int planned;
+  static char *kwlist[] = {"file", "filters", "capacity", "error_rate", "plan", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args,
+                                   kwargs,
+                                   "sk|ldO",
+                                   kwlist,
+                                   &path,
+                                   &filters,
+                                   &capacity,
+                                   &error_rate,
+                                   &plan_object))
+    return NULL;
+  // 'k' wraps negative values rather than rejecting them.
+  if (!filters || filters > MULTI_MAX_FILTERS) {
+    PyErr_Format(PyExc_ValueError, "filters must be between 1 and %llu", (unsigned long long)MULTI_MAX_FILTERS);
+    return NULL;
+  }
+  if ((planned = bloomfilter_plan_from_object(plan_object, &plan)) == -1)
+    return NULL;
+  if (planned) {
+    if (plan.layout != BLOOMFILTER_STANDARD) {
+      PyErr_SetString(PyExc_ValueError, "multi-filters only support the standard layout");
+      return NULL;
+    }
+    capacity = plan.capacity;
+    error_rate = plan.error_rate;
+  }
+
+  fd = open(path, O_CREAT|O_RDWR, ~0);
+  if (fd == -1)
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+
+  SharedMemoryMultiBloomfilterObject *self = PyObject_New(SharedMemoryMultiBloomfilterObject, type);
+  if (!self) {
+    close(fd);
+    return NULL;
+  }
+  if (!(self->mbf = create_multi_bloomfilter(fd, filters, capacity, error_rate, planned ? &plan : NULL))) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    close(fd);
+    PyObject_Del(self);
+    return NULL;
+  }
+  return (PyObject *)self;
+}
+
+PyTypeObject SharedMemoryMultiBloomfilterType = {
+  PyVarObject_HEAD_INIT(&PyType_Type, 0)
+  "SharedMemoryMultiBloomFilter", /* tp_name */
+  sizeof(SharedMemoryMultiBloomfilterObject), /* tp_basicsize */
+  0, /* tp_itemsize */
+  (destructor)peloton_multi_bloomfilter_type_dealloc, /* tp_dealloc */
+  0, /* tp_print */
+  0, /* tp_getattr */
+  0, /* tp_setattr */
+  0, /* tp_cmp */
+  0, /* tp_repr */
+  0, /* tp_as_number */
+  &SharedMemoryMultiBloomfilterObject_sequence_methods, /* tp_as_seqeunce */
+  0, 
+  (hashfunc)PyObject_HashNotImplemented, /*tp_hash */
+  0, /* tp_call */
+  0, /* tp_str */
+  PyObject_GenericGetAttr, /* tp_getattro */
+  0, /* tp_setattro */
+  0, /* tp_as_buffer */
+  Py_TPFLAGS_HAVE_SEQUENCE_IN,	/* tp_flags */
+  0, /* tp_doc */
+  0, /* tp_traverse */
+  0, /* tp_clear */
+  0, /* tp_richcompare */
+  0, /* tp_weaklistoffset */
+  0, /* tp_iter */
+  0, /* tp_iternext */
+  peloton_multi_bloomfilter_methods, /* tp_methods */
+  0, /* tp_members */
+  0, /* tp_genset */
+  0, /* tp_base */
+  0, /* tp_dict */
+  0,				/* tp_descr_get */
+  0,				/* tp_descr_set */
+  0,				/* tp_dictoffset */
+  0,				/* tp_init */
+  0,				/* tp_alloc */
+  peloton_multi_bloomfilter_new,	/* tp_new */
+  0,
+};
+
+
+// Sharded shared memory bloomfilter.  The top bits of the (mixed) hash
+// pick a shard; every shard is an ordinary SharedMemoryBloomFilter file
+// named "<file>.<shard>" with its own header and capacity counter, so
+// shards can be cleared, rotated and checkpointed independently.  "<file>"
+// itself is a manifest holding the shard count, so every process routes
+// keys to the same shards.
+
+const char SHARDED_HEADER[] = "SharedMemory BF Manifest";
+
+#define SHARDED_DEFAULT_SHARDS 16
+#define SHARDED_MAX_SHARDS ((uint64_t)1 << 16)
+
+#define MPOL_BIND_MODE 2
+#define MPOL_MOVE_FLAG 2
+#define MAX_NUMA_NODES 1024
+
+static int numa_node_count(void) {
+  DIR *dir = opendir("/sys/devices/system/node");
+  struct dirent *entry;
+  int nodes = 0;
+  if (!dir)
+    return 1;
+  while ((entry = readdir(dir)))
+    if (!strncmp(entry->d_name, "node", 4) && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+      nodes++;
+  closedir(dir);
+  return nodes ? nodes : 1;
+}
+
+// Best effort: returns -1 when the kernel refuses the policy, in which
+// case the mapping stays where it is.  Page cache pages of regular files
+// ignore memory policy; only shmem (tmpfs, /dev/shm) files honour it.
+static int numa_bind(void *addr, size_t size, int node) {
+#if defined(__linux__) && defined(SYS_mbind)
+  unsigned long mask[MAX_NUMA_NODES / (CHAR_BIT * sizeof(unsigned long))] = {0};
+  if (node < 0 || node >= MAX_NUMA_NODES)
+    return -1;
+  mask[node / (CHAR_BIT * sizeof(unsigned long))] |= 1UL << (node % (CHAR_BIT * sizeof(unsigned long)));
+  return syscall(SYS_mbind, addr, size, MPOL_BIND_MODE, mask, (unsigned long)MAX_NUMA_NODES, MPOL_MOVE_FLAG) ? -1 : 0;
+#else
+  return -1;
+#endif
+}
+
+typedef struct {
+  uint64_t shards;
+  int shard_bits;
+  char *path;
+  int *nodes;
+  bloomfilter_t **shard;
+} sharded_bloomfilter_t;
+
+typedef struct {
+  PyObject HEAD;
+  sharded_bloomfilter_t *sbf;
+} ShardedSharedMemoryBloomfilterObject;
+
+static inline uint64_t sharded_bloomfilter_shard(sharded_bloomfilter_t *sbf, uint64_t hash) {
+  if (!sbf->shard_bits)
+    return 0;
+  return (hash * PRIME_1) >> (64 - sbf->shard_bits);
+}
+
+static char *sharded_bloomfilter_path(const char *path, uint64_t shard) {
+  size_t size = strlen(path) + 24;
+  char *name = malloc(size);
+  if (name)
+    snprintf(name, size, "%s.%llu", path, (unsigned long long)shard);
+  return name;
+}
+
+// Keys land on shards binomially, so each shard is sized for its share
+// plus four standard deviations.  Without the margin the fullest shards
+// reach their own capacity and clear long before the filter as a whole
+// is full.
+static uint64_t sharded_bloomfilter_capacity(uint64_t capacity, uint64_t shards) {
+  double share = (double)capacity / shards;
+  return ceil(share + 4 * sqrt(share * (1 - 1.0 / shards)));
+}
+
+// Creates the manifest with requested shards (the default when 0), or
+// reads the stored count from an existing one.
+static int sharded_bloomfilter_manifest(const char *path, uint64_t requested, uint64_t *shards) {
+  char magicbuffer[24];
+  struct stat stats;
+  int result = -1;
+  int fd = open(path, O_CREAT|O_RDWR, ~0);
+  if (fd == -1)
+    return -1;
+  flock(fd, LOCK_EX);
+
+  if (fstat(fd, &stats))
+    goto done;
+  if (stats.st_size == 0) {
+    *shards = requested ? requested : SHARDED_DEFAULT_SHARDS;
+    if (write(fd, SHARDED_HEADER, 24) != 24 || write(fd, shards, sizeof(uint64_t)) != sizeof(uint64_t))
+      goto done;
+  } else if (read(fd, magicbuffer, 24) != 24
+             || strncmp(magicbuffer, SHARDED_HEADER, 24)
+             || read(fd, shards, sizeof(uint64_t)) != sizeof(uint64_t)
+             || !*shards || (*shards & (*shards - 1)) || *shards > SHARDED_MAX_SHARDS) {
+    errno = EINVAL;
+    goto done;
+  }
+  result = 0;
+
+ done:
+  flock(fd, LOCK_UN);
+  close(fd);
+  return result;
+}
+
+static void peloton_sharded_bloomfilter_destroy(sharded_bloomfilter_t *sbf) {
+  uint64_t i;
+  if (sbf->shard)
+    for (i = 0; i < sbf->shards; ++i)
+      if (sbf->shard[i])
+        peloton_shared_memory_bloomfilter_destroy(sbf->shard[i]);
+  free(sbf->shard);
+  free(sbf->nodes);
+  free(sbf->path);
+  free(sbf);
+}
+
+static PyObject *
+peloton_sharded_bloomfilter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+  char *path = NULL;
+  uint64_t requested = 0;
+  uint64_t shards;
+  uint64_t shard_capacity;
+  uint64_t capacity = 1000;
+  double error_rate = 1.0 / 128.0;
+  int numa = 1;
+  int numa_nodes;
+  PyObject *plan_object = NULL;
+  bloomfilter_plan_t plan;
+  int planned;
+  uint64_t i;
+  static char *kwlist[] = {"file", "shards", "capacity", "error_rate", "numa", "plan", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args,
+                                   kwargs,
+                                   "s|kkdiO",
+                                   kwlist,
+                                   &path,
+                                   &requested,
+                                   &capacity,
+                                   &error_rate,
+                                   &numa,
+                                   &plan_object))
+    return NULL;
+  if (requested && ((requested & (requested - 1)) || requested > SHARDED_MAX_SHARDS)) {
+    PyErr_Format(PyExc_ValueError, "shards must be a power of two no larger than %llu",
+                 (unsigned long long)SHARDED_MAX_SHARDS);
+    return NULL;
+  }
+  if ((planned = bloomfilter_plan_from_object(plan_object, &plan)) == -1)
+    return NULL;
+  if (planned) {
+    capacity = plan.capacity;
+    error_rate = plan.error_rate;
+  }
+  if (-1 == bloomfilter_probes(error_rate)) {
+    PyErr_SetString(PyExc_ValueError, "error_rate must be between 0 and 1");
+    return NULL;
+  }
+  if (sharded_bloomfilter_manifest(path, requested, &shards))
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+  if (requested && requested != shards) {
+    PyErr_Format(PyExc_ValueError, "%s has %llu shards, not %llu",
+                 path, (unsigned long long)shards, (unsigned long long)requested);
+    return NULL;
+  }
+  shard_capacity = sharded_bloomfilter_capacity(capacity, shards);
+  if (planned) {
+    // Bits scale with the shard's capacity, which keeps the planned
+    // error rate at the shard's expected load.
+    uint64_t unit = plan.layout == BLOOMFILTER_BLOCKED ? BLOOMFILTER_BLOCK_BITS : 64;
+    plan.bits = ((uint64_t)ceil((double)plan.bits * shard_capacity / plan.capacity) + unit - 1) / unit * unit;
+    plan.capacity = shard_capacity;
+    if (!bloomfilter_plan_valid(&plan)) {
+      PyErr_SetString(PyExc_ValueError, "plan is too large to shard");
+      return NULL;
+    }
+  }
+
+  ShardedSharedMemoryBloomfilterObject *self = PyObject_New(ShardedSharedMemoryBloomfilterObject, type);
+  if (!self)
+    return NULL;
+  sharded_bloomfilter_t *sbf = self->sbf = calloc(1, sizeof(sharded_bloomfilter_t));
+  if (!sbf
+      || !(sbf->path = strdup(path))
+      || !(sbf->shard = calloc(shards, sizeof(bloomfilter_t *)))
+      || !(sbf->nodes = calloc(shards, sizeof(int)))) {
+    PyErr_NoMemory();
+    goto error;
+  }
+  sbf->shards = shards;
+  while (((uint64_t)1 << sbf->shard_bits) < shards)
+    sbf->shard_bits++;
+
+  numa_nodes = numa ? numa_node_count() : 1;
+  for (i = 0; i < shards; ++i) {
+    char *name = sharded_bloomfilter_path(path, i);
+    int fd;
+    if (!name) {
+      PyErr_NoMemory();
+      goto error;
+    }
+    fd = open(name, O_CREAT|O_RDWR, ~0);
+    if (fd == -1 || !(sbf->shard[i] = create_bloomfilter(fd, shard_capacity, error_rate, planned ? &plan : NULL))) {
+      PyErr_SetFromErrnoWithFilename(PyExc_IOError, name);
+      if (fd != -1)
+        close(fd);
+      free(name);
+      goto error;
+    }
+    free(name);
+    sbf->nodes[i] = -1;
+    if (numa_nodes > 1 && !numa_bind(sbf->shard[i]->mmap, sbf->shard[i]->mmap_size, i % numa_nodes))
+      sbf->nodes[i] = i % numa_nodes;
+  }
+  return (PyObject *)self;
+
+ error:
+  if (sbf)
+    peloton_sharded_bloomfilter_destroy(sbf);
+  self->sbf = NULL;
+  Py_DECREF(self);
+  return NULL;
+}
+
+static void peloton_sharded_bloomfilter_type_dealloc(ShardedSharedMemoryBloomfilterObject *self) {
+  if (self->sbf)
+    peloton_sharded_bloomfilter_destroy(self->sbf);
+  PyObject_Del(self);
+}
+
+static int
+sharded_bloomfilter_index(sharded_bloomfilter_t *sbf, PyObject *arg, uint64_t *shard) {
+  long value = PyInt_AsLong(arg);
+  if (value == -1 && PyErr_Occurred())
+    return -1;
+  if (value < 0 || (uint64_t)value >= sbf->shards) {
+    PyErr_Format(PyExc_IndexError, "shard %ld out of range", value);
+    return -1;
+  }
+  *shard = value;
+  return 0;
+}
+
+static PyObject *
+peloton_sharded_bloomfilter_add(ShardedSharedMemoryBloomfilterObject *self, PyObject *item) {
+  uint64_t hash = PyObject_Hash(item);
+  if (hash == (uint64_t)(-1))
+    return NULL;
+  bloomfilter_t *bloomfilter = self->sbf->shard[sharded_bloomfilter_shard(self->sbf, hash)];
+
+  uint64_t count=(__atomic_fetch_sub(bloomfilter->counter, (uint64_t)1, 0));
+  uint64_t cleared = !count;
+  if (cleared || count > bloomfilter->capacity) {
+    bloomfilter_clear(bloomfilter);
+  }
+  Py_BEGIN_ALLOW_THREADS
+  bloomfilter_set_bits(bloomfilter, hash);
+  Py_END_ALLOW_THREADS
+  return PyBool_FromLong(cleared);
+}
+
+static int
+ShardedSharedMemoryBloomfilterObject_contains(ShardedSharedMemoryBloomfilterObject *self, PyObject *item) {
+  uint64_t hash = PyObject_Hash(item);
+  if (hash == (uint64_t)(-1))
+    return -1;
+  return bloomfilter_test_bits(self->sbf->shard[sharded_bloomfilter_shard(self->sbf, hash)], hash);
+}
+
+static Py_ssize_t
+ShardedSharedMemoryBloomfilterObject_len(ShardedSharedMemoryBloomfilterObject *self) {
+  sharded_bloomfilter_t *sbf = self->sbf;
+  Py_ssize_t length = 0;
+  uint64_t i;
+  for (i = 0; i < sbf->shards; ++i)
+    length += sbf->shard[i]->capacity - *sbf->shard[i]->counter;
+  return length;
+}
+
+static PyObject *
+peloton_sharded_bloomfilter_population(ShardedSharedMemoryBloomfilterObject *self, PyObject *_) {
+  sharded_bloomfilter_t *sbf = self->sbf;
+  uint64_t population = 0;
+  uint64_t i, j;
+  for (i = 0; i < sbf->shards; ++i)
+    for (j = 0; j < sbf->shard[i]->length; ++j)
+      population += __builtin_popcountll(sbf->shard[i]->bits[j]);
+  return PyInt_FromSize_t(population);
+}
+
+static PyObject *
+peloton_sharded_bloomfilter_clear(ShardedSharedMemoryBloomfilterObject *self, PyObject *_) {
+  uint64_t i;
+  for (i = 0; i < self->sbf->shards; ++i)
+    bloomfilter_clear(self->sbf->shard[i]);
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+peloton_sharded_bloomfilter_shard(ShardedSharedMemoryBloomfilterObject *self, PyObject *item) {
+  uint64_t hash = PyObject_Hash(item);
+  if (hash == (uint64_t)(-1))
+    return NULL;
+  return PyInt_FromSize_t(sharded_bloomfilter_shard(self->sbf, hash));
+}
+
+static PyObject *
+peloton_sharded_bloomfilter_node(ShardedSharedMemoryBloomfilterObject *self, PyObject *arg) {
+  uint64_t shard;
+  if (sharded_bloomfilter_index(self->sbf, arg, &shard))
+    return NULL;
+  return PyInt_FromLong(self->sbf->nodes[shard]);
+}
+
+static PyObject *
+peloton_sharded_bloomfilter_clear_shard(ShardedSharedMemoryBloomfilterObject *self, PyObject *arg) {
+  uint64_t shard;
+  if (sharded_bloomfilter_index(self->sbf, arg, &shard))
+    return NULL;
+  bloomfilter_clear(self->sbf->shard[shard]);
+  Py_RETURN_NONE;
+}
+
+// Flushes a shard to its own file and, given a path, writes a copy of it
+// there via a temporary file and rename so readers never see a partial
+// checkpoint.  The copy is an ordinary SharedMemoryBloomFilter file.
+static int sharded_bloomfilter_checkpoint(bloomfilter_t *bf, const char *path) {
+  char *tmp;
+  size_t size;
+  size_t written = 0;
+  ssize_t n;
+  int saved;
+  int fd;
+
+  if (msync(bf->mmap, bf->mmap_size, MS_SYNC))
+    return -1;
+  if (!path)
+    return 0;
+  size = strlen(path) + 5;
+  if (!(tmp = malloc(size)))
+    return -1;
+  snprintf(tmp, size, "%s.tmp", path);
+  fd = open(tmp, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+  if (fd == -1)
+    goto error;
+  while (written < bf->mmap_size) {
+    n = write(fd, (char *)bf->mmap + written, bf->mmap_size - written);
+    if (n <= 0) {
+      if (!n)
+        errno = EIO;
+      goto error;
+    }
+    written += n;
+  }
+  if (fsync(fd))
+    goto error;
+  n = close(fd);
+  fd = -1;
+  if (n || rename(tmp, path))
+    goto error;
+  free(tmp);
+  return 0;
+
+ error:
+  // Cleanup must not clobber the errno reported to Python.
+  saved = errno;
+  if (fd != -1)
+    close(fd);
+  unlink(tmp);
+  free(tmp);
+  errno = saved;
+  return -1;
+}
+
+static PyObject *
+peloton_sharded_bloomfilter_checkpoint_shard(ShardedSharedMemoryBloomfilterObject *self, PyObject *args) {
+  PyObject *arg;
+  char *path = NULL;
+  uint64_t shard;
+  int failed;
+  if (!PyArg_ParseTuple(args, "O|z", &arg, &path))
+    return NULL;
+  if (sharded_bloomfilter_index(self->sbf, arg, &shard))
+    return NULL;
+  bloomfilter_t *bf = self->sbf->shard[shard];
+  Py_BEGIN_ALLOW_THREADS
+  failed = sharded_bloomfilter_checkpoint(bf, path);
+  Py_END_ALLOW_THREADS
+  if (failed)
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+peloton_sharded_bloomfilter_rotate_shard(ShardedSharedMemoryBloomfilterObject *self, PyObject *args) {
+  PyObject *arg;
+  char *path = NULL;
+  uint64_t shard;
+  int failed = 0;
+  if (!PyArg_ParseTuple(args, "O|z", &arg, &path))
+    return NULL;
+  if (sharded_bloomfilter_index(self->sbf, arg, &shard))
+    return NULL;
+  bloomfilter_t *bf = self->sbf->shard[shard];
+  if (path) {
+    Py_BEGIN_ALLOW_THREADS
+    failed = sharded_bloomfilter_checkpoint(bf, path);
+    Py_END_ALLOW_THREADS
+  }
+  if (failed)
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+  bloomfilter_clear(bf);
+  Py_RETURN_NONE;
+}
+
+static PySequenceMethods ShardedSharedMemoryBloomfilterObject_sequence_methods = {
+  (lenfunc)ShardedSharedMemoryBloomfilterObject_len, /* sq_length */
+  0,				/* sq_concat */
+  0,				/* sq_repeat */
+  0,				/* sq_item */
+  0,				/* sq_slice */
+  0,				/* sq_ass_item */
+  0,				/* sq_ass_slice */
+  (objobjproc)ShardedSharedMemoryBloomfilterObject_contains,	/* sq_contains */
+};
+
+static PyMethodDef peloton_sharded_bloomfilter_methods[] = {
+  {"add", (PyCFunction)peloton_sharded_bloomfilter_add, METH_O, NULL},
+  {"clear", (PyCFunction)peloton_sharded_bloomfilter_clear, METH_NOARGS, NULL},
+  {"population", (PyCFunction)peloton_sharded_bloomfilter_population, METH_NOARGS, NULL},
+  {"shard", (PyCFunction)peloton_sharded_bloomfilter_shard, METH_O, "shard(item): index of the shard holding item"},
+  {"node", (PyCFunction)peloton_sharded_bloomfilter_node, METH_O, "node(shard): NUMA node a shard is bound to, or -1"},
+  {"clear_shard", (PyCFunction)peloton_sharded_bloomfilter_clear_shard, METH_O, "clear_shard(shard): clear a single shard"},
+  {"checkpoint_shard", (PyCFunction)peloton_sharded_bloomfilter_checkpoint_shard, METH_VARARGS, "checkpoint_shard(shard[, path]): flush a shard to disk, optionally copying it to path"},
+  {"rotate_shard", (PyCFunction)peloton_sharded_bloomfilter_rotate_shard, METH_VARARGS, "rotate_shard(shard[, path]): checkpoint a shard to path, then clear it"},
+  {NULL, NULL}
+};
+
+PyTypeObject ShardedSharedMemoryBloomfilterType = {
+  PyVarObject_HEAD_INIT(&PyType_Type, 0)
+  "ShardedSharedMemoryBloomFilter", /* tp_name */
+  sizeof(ShardedSharedMemoryBloomfilterObject), /* tp_basicsize */
+  0, /* tp_itemsize */
+  (destructor)peloton_sharded_bloomfilter_type_dealloc, /* tp_dealloc */
+  0, /* tp_print */
+  0, /* tp_getattr */
+  0, /* tp_setattr */
+  0, /* tp_cmp */
+  0, /* tp_repr */
+  0, /* tp_as_number */
+  &ShardedSharedMemoryBloomfilterObject_sequence_methods, /* tp_as_seqeunce */
+  0, 
+  (hashfunc)PyObject_HashNotImplemented, /*tp_hash */
+  0, /* tp_call */
+  0, /* tp_str */
+  PyObject_GenericGetAttr, /* tp_getattro */
+  0, /* tp_setattro */
+  0, /* tp_as_buffer */
+  Py_TPFLAGS_HAVE_SEQUENCE_IN,	/* tp_flags */
+  0, /* tp_doc */
+  0, /* tp_traverse */
+  0, /* tp_clear */
+  0, /* tp_richcompare */
+  0, /* tp_weaklistoffset */
+  0, /* tp_iter */
+  0, /* tp_iternext */
+  peloton_sharded_bloomfilter_methods, /* tp_methods */
+  0, /* tp_members */
+  0, /* tp_genset */
+  0, /* tp_base */
+  0, /* tp_dict */
+  0,				/* tp_descr_get */
+  0,				/* tp_descr_set */
+  0,				/* tp_dictoffset */
+  0,				/* tp_init */
+  0,				/* tp_alloc */
+  peloton_sharded_bloomfilter_new,	/* tp_new */
+  0,
+};
+
+
+// Shared memory cuckoo filter.  Each bucket holds four fingerprints of
+// 4 to 32 bits.  Slots are packed into 64 bit words without straddling
+// them, so each slot can be swapped atomically and a bucket spans at most
+// two words.  An item lives in bucket i1 or in
+// i2 = (H(fingerprint) - i1) mod buckets, which maps each back to the
+// other for any bucket count.
+//
+// Inserts into a free slot are lock free compare and swaps on single
+// slots.  Evictions, deletes and clears take a writer lock in the header
+// and bump a seqlock version to odd before touching the table and back
+// to even after.  A lookup that misses retries while the version is odd
+// or has changed, since an eviction may have moved the fingerprint from
+// the bucket not yet scanned into the one already scanned.
+//
+// Layout: CUCKOO_HEADER, capacity, error_rate, count, lock, version and
+// then the buckets at 64 bytes.
+
+const char CUCKOO_HEADER[] = "SharedMemoryCuckooFilter";
+
+#define CUCKOO_SLOTS 4
+#define CUCKOO_MAX_LOAD 0.95
+#define CUCKOO_MAX_KICKS 500
+#define CUCKOO_TABLE_OFFSET 64
+#define CUCKOO_MIN_BITS 4
+#define CUCKOO_MAX_BITS 32
+
+typedef struct {
+  int fd;
+  uint64_t capacity;
+  double error_rate;
+  uint64_t buckets;
+  uint64_t words;
+  int bits;
+  int per_word;
+  uint32_t mask;
+  void *mmap;
+  size_t mmap_size;
+  uint64_t *count;
+  uint64_t *lock;
+  uint64_t *version;
+  void *table;
+  struct magicu_info divisor;
+} cuckoofilter_t;
+
+typedef struct {
+  PyObject HEAD;
+  cuckoofilter_t *cf;
+} SharedMemoryCuckooFilterObject;
+
+// Fingerprint bits needed for error_rate: two buckets of four slots
+// give 8 chances of a fingerprint collision per lookup, so about
+// log2(8 / error_rate) bits.  The width is then widened to use every bit
+// of the word at the same slot count, e.g. 17 bits become 21 at three
+// slots a word, which lowers the error rate at no cost in space.  Error
+// rates below 8 / 2**32 are capped at 32 bit fingerprints.
+static int cuckoofilter_bits(double error_rate, int *per_word) {
+  int bits = ceil(log2(8 / error_rate));
+  if (bits < CUCKOO_MIN_BITS)
+    bits = CUCKOO_MIN_BITS;
+  if (bits > CUCKOO_MAX_BITS)
+    bits = CUCKOO_MAX_BITS;
+  *per_word = 64 / bits;
+  bits = 64 / *per_word;
+  return bits > CUCKOO_MAX_BITS ? CUCKOO_MAX_BITS : bits;
+}
+
+static void cuckoofilter_layout(cuckoofilter_t *cf) {
+  cf->bits = cuckoofilter_bits(cf->error_rate, &cf->per_word);
+  cf->mask = cf->bits == 32 ? UINT32_MAX : ((uint32_t)1 << cf->bits) - 1;
+  cf->buckets = ceil(cf->capacity / (CUCKOO_SLOTS * CUCKOO_MAX_LOAD));
+  if (!cf->buckets)
+    cf->buckets = 1;
+  cf->words = (cf->buckets * CUCKOO_SLOTS + cf->per_word - 1) / cf->per_word;
+  cf->divisor = compute_unsigned_magic_info(cf->buckets, 64);
+  cf->mmap_size = CUCKOO_TABLE_OFFSET + cf->words * sizeof(uint64_t);
+}
+
+static inline uint64_t *cuckoo_word(cuckoofilter_t *cf, uint64_t bucket, int slot, int *shift) {
+  uint64_t i = bucket * CUCKOO_SLOTS + slot;
+  uint64_t word = i / cf->per_word;
+  *shift = (i - word * cf->per_word) * cf->bits;
+  return (uint64_t *)cf->table + word;
+}
+
+static inline uint32_t cuckoo_get(cuckoofilter_t *cf, uint64_t bucket, int slot) {
+  int shift;
+  uint64_t *word = cuckoo_word(cf, bucket, slot, &shift);
+  return (__atomic_load_n(word, __ATOMIC_RELAXED) >> shift) & cf->mask;
+}
+
+// Swaps one slot; retries while other slots of the same word change.
+static inline int cuckoo_cas(cuckoofilter_t *cf, uint64_t bucket, int slot, uint32_t old, uint32_t new) {
+  int shift;
+  uint64_t *word = cuckoo_word(cf, bucket, slot, &shift);
+  uint64_t mask = (uint64_t)cf->mask << shift;
+  uint64_t current = __atomic_load_n(word, __ATOMIC_RELAXED);
+  while (1) {
+    if (((current & mask) >> shift) != old)
+      return 0;
+    if (__atomic_compare_exchange_n(word, &current, (current & ~mask) | ((uint64_t)new << shift),
+                                    0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      return 1;
+  }
+}
+
+static inline uint64_t cuckoo_alt(cuckoofilter_t *cf, uint64_t bucket, uint32_t fingerprint) {
+  uint64_t h = magic_mod(xxh64(fingerprint), &cf->divisor, cf->buckets);
+  return h >= bucket ? h - bucket : h + cf->buckets - bucket;
+}
+
+static inline void cuckoo_locate(cuckoofilter_t *cf, uint64_t hash, uint32_t *fingerprint, uint64_t *i1, uint64_t *i2) {
+  hash = xxh64(hash);
+  *fingerprint = (hash >> 32) & cf->mask;
+  if (!*fingerprint)
+    *fingerprint = 1;
+  *i1 = magic_mod(hash, &cf->divisor, cf->buckets);
+  *i2 = cuckoo_alt(cf, *i1, *fingerprint);
+}
+
+static inline int cuckoo_find(cuckoofilter_t *cf, uint64_t bucket, uint32_t value) {
+  int slot;
+  for (slot = 0; slot < CUCKOO_SLOTS; ++slot)
+    if (cuckoo_get(cf, bucket, slot) == value)
+      return slot;
+  return -1;
+}
+
+static int cuckoo_insert_free(cuckoofilter_t *cf, uint64_t bucket, uint32_t fingerprint) {
+  int slot;
+  for (slot = 0; slot < CUCKOO_SLOTS; ++slot)
+    if (!cuckoo_get(cf, bucket, slot) && cuckoo_cas(cf, bucket, slot, 0, fingerprint))
+      return 1;
+  return 0;
+}
+
+// The writer lock holds the pid of its owner so a lock left behind by a
+// process that died can be taken over.
+static uint64_t cuckoo_dead_owner(cuckoofilter_t *cf) {
+  uint64_t owner = __atomic_load_n(cf->lock, __ATOMIC_ACQUIRE);
+  return owner && kill((pid_t)owner, 0) == -1 && errno == ESRCH ? owner : 0;
+}
+
+static void cuckoo_lock(cuckoofilter_t *cf) {
+  uint64_t pid = getpid();
+  uint64_t owner;
+  unsigned spins = 0;
+  while (!__sync_bool_compare_and_swap(cf->lock, 0, pid)) {
+    if (!(++spins & 0x3ff) && (owner = cuckoo_dead_owner(cf))
+        && __sync_bool_compare_and_swap(cf->lock, owner, pid)) {
+      // The owner died inside a write section; close it for readers.
+      if (__atomic_load_n(cf->version, __ATOMIC_ACQUIRE) & 1)
+        __atomic_add_fetch(cf->version, 1, __ATOMIC_RELEASE);
+      return;
+    }
+    sched_yield();
+  }
+}
+
+static void cuckoo_unlock(cuckoofilter_t *cf) {
+  __sync_bool_compare_and_swap(cf->lock, (uint64_t)getpid(), 0);
+}
+
+// Write sections run under the writer lock.
+static inline void cuckoo_write_begin(cuckoofilter_t *cf) {
+  __atomic_add_fetch(cf->version, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void cuckoo_write_end(cuckoofilter_t *cf) {
+  __atomic_add_fetch(cf->version, 1, __ATOMIC_SEQ_CST);
+}
+
+static int cuckoo_lookup(cuckoofilter_t *cf, uint32_t fingerprint, uint64_t i1, uint64_t i2) {
+  uint64_t version;
+  unsigned spins = 0;
+  int found;
+  while (1) {
+    version = __atomic_load_n(cf->version, __ATOMIC_ACQUIRE);
+    if (version & 1) {
+      // A writer that died mid section leaves the version odd until the
+      // next writer takes its lock; fall back to a best effort read.
+      if (!(++spins & 0x3ff) && cuckoo_dead_owner(cf))
+        return cuckoo_find(cf, i1, fingerprint) >= 0 || cuckoo_find(cf, i2, fingerprint) >= 0;
+      sched_yield();
+      continue;
+    }
+    found = cuckoo_find(cf, i1, fingerprint) >= 0 || cuckoo_find(cf, i2, fingerprint) >= 0;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (found || __atomic_load_n(cf->version, __ATOMIC_RELAXED) == version)
+      return found;
+  }
+}
+
+typedef struct {
+  uint64_t bucket;
+  int slot;
+  uint32_t fingerprint;
+} cuckoo_step_t;
+
+// Random walk from bucket for a free slot, then shift the fingerprints
+// along the path into it.  Must hold the writer lock; slots on the path
+// can then only change if a lock free insert takes the free slot first,
+// which is detected before anything moves.  The moves run inside a
+// seqlock write section.
+static int cuckoo_kick(cuckoofilter_t *cf, uint64_t bucket, uint32_t fingerprint, uint64_t seed) {
+  cuckoo_step_t path[CUCKOO_MAX_KICKS];
+  int attempt;
+
+  for (attempt = 0; attempt < 8; ++attempt) {
+    uint64_t current = bucket;
+    int depth = 0;
+    int free_slot = -1;
+    while (depth < CUCKOO_MAX_KICKS) {
+      int slot, tries, j;
+      for (tries = 0; tries < CUCKOO_SLOTS; ++tries) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        slot = seed % CUCKOO_SLOTS;
+        for (j = 0; j < depth; ++j)
+          if (path[j].bucket == current && path[j].slot == slot)
+            break;
+        if (j == depth)
+          break;
+      }
+      if (tries == CUCKOO_SLOTS)
+        break;
+      path[depth].bucket = current;
+      path[depth].slot = slot;
+      path[depth].fingerprint = cuckoo_get(cf, current, slot);
+      current = cuckoo_alt(cf, current, path[depth].fingerprint);
+      depth++;
+      if ((free_slot = cuckoo_find(cf, current, 0)) >= 0)
+        break;
+    }
+    if (free_slot < 0)
+      continue;
+    cuckoo_write_begin(cf);
+    if (!cuckoo_cas(cf, current, free_slot, 0, path[depth - 1].fingerprint)) {
+      cuckoo_write_end(cf);
+      continue;
+    }
+    while (--depth > 0)
+      cuckoo_cas(cf, path[depth].bucket, path[depth].slot, path[depth].fingerprint, path[depth - 1].fingerprint);
+    cuckoo_cas(cf, path[0].bucket, path[0].slot, path[0].fingerprint, fingerprint);
+    cuckoo_write_end(cf);
+    return 1;
+  }
+  return 0;
+}
+
+static void peloton_cuckoofilter_destroy(cuckoofilter_t *cf) {
+  if (cf->mmap)
+    munmap(cf->mmap, cf->mmap_size);
+  if (cf->fd)
+    close(cf->fd);
+  free(cf);
+}
+
+static cuckoofilter_t *create_cuckoofilter(int fd, uint64_t capacity, double error_rate) {
+  cuckoofilter_t *cf;
+  char magicbuffer[24];
+  struct stat stats;
+  uint64_t zero = 0;
+
+  if ((error_rate <= 0) || (error_rate >= 1) || !capacity) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (!(cf = calloc(1, sizeof(cuckoofilter_t))))
+    return NULL;
+  flock(fd, LOCK_EX);
+
+  if (fstat(fd, &stats))
+    goto error;
+  if (stats.st_size == 0) {
+    cf->capacity = capacity;
+    cf->error_rate = error_rate;
+    cuckoofilter_layout(cf);
+    if (write(fd, CUCKOO_HEADER, 24) != 24
+        || write(fd, &capacity, sizeof(uint64_t)) != sizeof(uint64_t)
+        || write(fd, &error_rate, sizeof(double)) != sizeof(double)
+        || write(fd, &zero, sizeof(uint64_t)) != sizeof(uint64_t)
+        || write(fd, &zero, sizeof(uint64_t)) != sizeof(uint64_t)
+        || write(fd, &zero, sizeof(uint64_t)) != sizeof(uint64_t)
+        || ftruncate(fd, cf->mmap_size))
+      goto error;
+  } else {
+    lseek(fd, 0, 0);
+    if (read(fd, magicbuffer, 24) != 24 || strncmp(magicbuffer, CUCKOO_HEADER, 24))
+      goto invalid;
+    if (read(fd, &cf->capacity, sizeof(uint64_t)) != sizeof(uint64_t))
+      goto invalid;
+    if (read(fd, &cf->error_rate, sizeof(double)) != sizeof(double))
+      goto invalid;
+    if ((cf->error_rate <= 0) || (cf->error_rate >= 1) || !cf->capacity)
+      goto invalid;
+    cuckoofilter_layout(cf);
+    if ((size_t)stats.st_size < cf->mmap_size)
+      goto invalid;
+  }
+  flock(fd, LOCK_UN);
+
+  if (!(cf->mmap = map_shared_file(fd, cf->mmap_size)))
+    goto error_unlocked;
+  cf->fd = fd;
+  cf->count = cf->mmap + 24 + sizeof(uint64_t) + sizeof(double);
+  cf->lock = cf->count + 1;
+  cf->version = cf->lock + 1;
+  cf->table = cf->mmap + CUCKOO_TABLE_OFFSET;
+  return cf;
+
+ invalid:
+  errno = EINVAL;
+ error:
+  flock(fd, LOCK_UN);
+ error_unlocked:
+  free(cf);
+  return NULL;
+}
+
+static PyObject *
+peloton_cuckoofilter_add(SharedMemoryCuckooFilterObject *self, PyObject *item) {
+  cuckoofilter_t *cf = self->cf;
+  uint32_t fingerprint;
+  uint64_t i1, i2;
+  int inserted;
+  uint64_t hash = PyObject_Hash(item);
+  if (hash == (uint64_t)(-1))
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  cuckoo_locate(cf, hash, &fingerprint, &i1, &i2);
+  inserted = cuckoo_insert_free(cf, i1, fingerprint) || cuckoo_insert_free(cf, i2, fingerprint);
+  if (!inserted) {
+    cuckoo_lock(cf);
+    inserted = cuckoo_insert_free(cf, i1, fingerprint)
+      || cuckoo_insert_free(cf, i2, fingerprint)
+      || cuckoo_kick(cf, hash & 1 ? i2 : i1, fingerprint, hash | 1);
+    cuckoo_unlock(cf);
+  }
+  if (inserted)
+    __sync_add_and_fetch(cf->count, 1);
+  Py_END_ALLOW_THREADS
+  return PyBool_FromLong(inserted);
+}
+
+static PyObject *
+peloton_cuckoofilter_remove(SharedMemoryCuckooFilterObject *self, PyObject *item) {
+  cuckoofilter_t *cf = self->cf;
+  uint32_t fingerprint;
+  uint64_t i1, i2;
+  int slot;
+  int removed = 0;
+  uint64_t hash = PyObject_Hash(item);
+  if (hash == (uint64_t)(-1))
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  cuckoo_locate(cf, hash, &fingerprint, &i1, &i2);
+  cuckoo_lock(cf);
+  cuckoo_write_begin(cf);
+  if ((slot = cuckoo_find(cf, i1, fingerprint)) >= 0)
+    removed = cuckoo_cas(cf, i1, slot, fingerprint, 0);
+  else if ((slot = cuckoo_find(cf, i2, fingerprint)) >= 0)
+    removed = cuckoo_cas(cf, i2, slot, fingerprint, 0);
+  cuckoo_write_end(cf);
+  cuckoo_unlock(cf);
+  if (removed)
+    __sync_sub_and_fetch(cf->count, 1);
+  Py_END_ALLOW_THREADS
+  return PyBool_FromLong(removed);
+}
+
+static int
+SharedMemoryCuckooFilterObject_contains(SharedMemoryCuckooFilterObject *self, PyObject *item) {
+  cuckoofilter_t *cf = self->cf;
+  uint32_t fingerprint;
+  uint64_t i1, i2;
+  uint64_t hash = PyObject_Hash(item);
+  if (hash == (uint64_t)(-1))
+    return -1;
+  cuckoo_locate(cf, hash, &fingerprint, &i1, &i2);
+  return cuckoo_lookup(cf, fingerprint, i1, i2);
+}
+
+static Py_ssize_t
+SharedMemoryCuckooFilterObject_len(SharedMemoryCuckooFilterObject *self) {
+  return *self->cf->count;
+}
+
+static PyObject *
+peloton_cuckoofilter_clear(SharedMemoryCuckooFilterObject *self, PyObject *_) {
+  cuckoofilter_t *cf = self->cf;
+  cuckoo_lock(cf);
+  cuckoo_write_begin(cf);
+  memset(cf->table, 0, cf->words * sizeof(uint64_t));
+  *cf->count = 0;
+  cuckoo_write_end(cf);
+  cuckoo_unlock(cf);
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+peloton_cuckoofilter_load_factor(SharedMemoryCuckooFilterObject *self, PyObject *_) {
+  cuckoofilter_t *cf = self->cf;
+  return PyFloat_FromDouble((double)*cf->count / (cf->buckets * CUCKOO_SLOTS));
+}
+
+static PySequenceMethods SharedMemoryCuckooFilterObject_sequence_methods = {
+  (lenfunc)SharedMemoryCuckooFilterObject_len, /* sq_length */
+  0,				/* sq_concat */
+  0,				/* sq_repeat */
+  0,				/* sq_item */
+  0,				/* sq_slice */
+  0,				/* sq_ass_item */
+  0,				/* sq_ass_slice */
+  (objobjproc)SharedMemoryCuckooFilterObject_contains,	/* sq_contains */
+};
+
+static PyMethodDef peloton_cuckoofilter_methods[] = {
+  {"add", (PyCFunction)peloton_cuckoofilter_add, METH_O, "add(item): True if stored, False if the filter is too full"},
+  {"remove", (PyCFunction)peloton_cuckoofilter_remove, METH_O, "remove(item): remove a previously added item, True if found"},
+  {"clear", (PyCFunction)peloton_cuckoofilter_clear, METH_NOARGS, NULL},
+  {"load_factor", (PyCFunction)peloton_cuckoofilter_load_factor, METH_NOARGS, "load_factor(): fraction of fingerprint slots in use"},
+  {NULL, NULL}
+};
+
+static void peloton_cuckoofilter_type_dealloc(SharedMemoryCuckooFilterObject *self) {
+  if (self->cf)
+    peloton_cuckoofilter_destroy(self->cf);
+  PyObject_Del(self);
+}
+
+static PyObject *
+peloton_cuckoofilter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+  int fd;
+  char *path = NULL;
+  uint64_t capacity = 1000;
+  double error_rate = 1.0 / 128.0;
+  static char *kwlist[] = {"file", "capacity", "error_rate", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args,
+                                   kwargs,
+                                   "s|kd",
+                                   kwlist,
+                                   &path,
+                                   &capacity,
+                                   &error_rate))
+    return NULL;
+
+  fd = open(path, O_CREAT|O_RDWR, ~0);
+  if (fd == -1)
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+
+  SharedMemoryCuckooFilterObject *self = PyObject_New(SharedMemoryCuckooFilterObject, type);
+  if (!self) {
+    close(fd);
+    return NULL;
+  }
+  if (!(self->cf = create_cuckoofilter(fd, capacity, error_rate))) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    close(fd);
+    PyObject_Del(self);
+    return NULL;
+  }
+  return (PyObject *)self;
+}
+
+PyTypeObject SharedMemoryCuckooFilterType = {
+  PyVarObject_HEAD_INIT(&PyType_Type, 0)
+  "SharedMemoryCuckooFilter", /* tp_name */
+  sizeof(SharedMemoryCuckooFilterObject), /* tp_basicsize */
+  0, /* tp_itemsize */
+  (destructor)peloton_cuckoofilter_type_dealloc, /* tp_dealloc */
+  0, /* tp_print */
+  0, /* tp_getattr */
+  0, /* tp_setattr */
+  0, /* tp_cmp */
+  0, /* tp_repr */
+  0, /* tp_as_number */
+  &SharedMemoryCuckooFilterObject_sequence_methods, /* tp_as_seqeunce */
+  0, 
+  (hashfunc)PyObject_HashNotImplemented, /*tp_hash */
+  0, /* tp_call */
+  0, /* tp_str */
+  PyObject_GenericGetAttr, /* tp_getattro */
+  0, /* tp_setattro */
+  0, /* tp_as_buffer */
+  Py_TPFLAGS_HAVE_SEQUENCE_IN,	/* tp_flags */
+  0, /* tp_doc */
+  0, /* tp_traverse */
+  0, /* tp_clear */
+  0, /* tp_richcompare */
+  0, /* tp_weaklistoffset */
+  0, /* tp_iter */
+  0, /* tp_iternext */
+  peloton_cuckoofilter_methods, /* tp_methods */
+  0, /* tp_members */
+  0, /* tp_genset */
+  0, /* tp_base */
+  0, /* tp_dict */
+  0,				/* tp_descr_get */
+  0,				/* tp_descr_set */
+  0,				/* tp_dictoffset */
+  0,				/* tp_init */
+  0,				/* tp_alloc */
+  peloton_cuckoofilter_new,	/* tp_new */
+  0,
+};
+
+
+typedef struct {
+  snapshot_t *snapshot;
+  snapshot_t *base;
+  uint64_t *bits;
+  uint64_t first;
+  uint64_t last;
+  int failed;
+} snapshot_worker_t;
+
+static void *snapshot_import_blocks(void *arg) {
+  snapshot_worker_t *worker = arg;
+  uint64_t block;
+  for (block = worker->first; block < worker->last; ++block) {
+    uint64_t *words = worker->bits + block * SNAPSHOT_BLOCK_WORDS;
+    if ((worker->base && snapshot_decode_block(worker->base, block, words))
+        || snapshot_decode_block(worker->snapshot, block, words)) {
+      worker->failed = 1;
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Decodes the blocks of snapshot (xored onto base, if given) into bits
+// using up to threads threads; returns -1 if any block is corrupt.
+static int snapshot_import(snapshot_t *snapshot, snapshot_t *base, uint64_t *bits, long threads) {
+  uint64_t blocks = snapshot->header->blocks;
+  snapshot_worker_t *workers;
+  pthread_t *ids;
+  long started = 0;
+  long i;
+  int failed = 0;
+
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads <= 0)
+    threads = 1;
+  if ((uint64_t)threads > blocks)
+    threads = blocks ? blocks : 1;
+  workers = calloc(threads, sizeof(snapshot_worker_t));
+  ids = calloc(threads, sizeof(pthread_t));
+  if (!workers || !ids) {
+    free(workers);
+    free(ids);
+    return -1;
+  }
+  for (i = 0; i < threads; ++i) {
+    workers[i].snapshot = snapshot;
+    workers[i].base = base;
+    workers[i].bits = bits;
+    workers[i].first = blocks * i / threads;
+    workers[i].last = blocks * (i + 1) / threads;
+  }
+  // The calling thread takes the first range itself.
+  for (i = 1; i < threads; ++i) {
+    if (pthread_create(ids + i, NULL, snapshot_import_blocks, workers + i))
+      break;
+    started = i;
+  }
+  for (i = started + 1; i < threads; ++i)
+    snapshot_import_blocks(workers + i);
+  snapshot_import_blocks(workers);
+  for (i = 1; i <= started; ++i)
+    pthread_join(ids[i], NULL);
+  for (i = 0; i < threads; ++i)
+    failed |= workers[i].failed;
+  free(workers);
+  free(ids);
+  return failed ? -1 : 0;
+}
+
+static PyObject *
+peloton_bloomfilter_import_snapshot(PyObject *self, PyObject *args, PyObject *kwargs) {
+  static char *kwlist[] = {"snapshot", "file", "base", "threads", NULL};
+  char *snapshot_path = NULL;
+  char *path = NULL;
+  char *base_path = NULL;
+  char *tmp = NULL;
+  long threads = 0;
+  snapshot_t snapshot = {NULL};
+  snapshot_t base = {NULL};
+  snapshot_header_t *header;
+  bloomfilter_plan_t plan;
+  PyObject *smbo = NULL;
+  bloomfilter_t *bf;
+  int failed;
+  int fd;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ss|zl", kwlist, &snapshot_path, &path, &base_path, &threads))
+    return NULL;
+  if (snapshot_open(&snapshot, snapshot_path))
+    return NULL;
+  header = snapshot.header;
+
+  if (!!(header->flags & SNAPSHOT_DELTA) != !!base_path) {
+    PyErr_Format(PyExc_ValueError,
+                 header->flags & SNAPSHOT_DELTA ? "%s is a delta snapshot and needs its base" : "%s is not a delta snapshot",
+                 snapshot_path);
+    goto done;
+  }
+  if (base_path) {
+    if (snapshot_open(&base, base_path))
+      goto done;
+    if (base.header->flags & SNAPSHOT_DELTA
+        || !snapshot_matches(&snapshot, &base)
+        || snapshot_checksum(base.map, base.size) != header->base_checksum) {
+      PyErr_Format(PyExc_ValueError, "%s is not the base of %s", base_path, snapshot_path);
+      goto done;
+    }
+  }
+  if (snapshot.plan) {
+    plan.capacity = header->capacity;
+    plan.error_rate = header->error_rate;
+  }
+  if (-1 == bloomfilter_probes(header->error_rate)
+      || (snapshot.plan
+          ? !bloomfilter_plan_from_shape(&plan, snapshot.plan->bits, snapshot.plan->probes, snapshot.plan->layout)
+            || (plan.bits + 63) / 64 != header->length
+          : (bloomfilter_size(header->capacity, header->error_rate) + 63) / 64 != header->length)) {
+    PyErr_Format(PyExc_ValueError, "%s is not a bloomfilter snapshot", snapshot_path);
+    goto done;
+  }
+
+  // Restore into a new file next to the destination and rename it into
+  // place, so processes that have the old file mapped are undisturbed.
+  if (!(tmp = malloc(strlen(path) + 5))) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  sprintf(tmp, "%s.tmp", path);
+  fd = open(tmp, O_CREAT|O_TRUNC|O_RDWR, ~0);
+  if (fd == -1) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, tmp);
+    goto done;
+  }
+  if (bloomfilter_write_header(fd, header->capacity, header->error_rate, header->counter, snapshot.plan ? &plan : NULL)
+      || ftruncate(fd, bloomfilter_bits_offset(snapshot.plan ? plan.layout : BLOOMFILTER_LEGACY) + header->length * sizeof(uint64_t))
+      || !(smbo = make_new_peloton_bloomfilter(&SharedMemoryBloomfilterType, fd, header->capacity, header->error_rate,
+                                               snapshot.plan ? &plan : NULL))) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, tmp);
+    close(fd);
+    unlink(tmp);
+    goto done;
+  }
+  bf = ((SharedMemoryBloomfilterObject *)smbo)->bf;
+
+  Py_BEGIN_ALLOW_THREADS
+  madvise(bf->bits, bf->length * sizeof(uint64_t), MADV_SEQUENTIAL);
+  failed = snapshot_import(&snapshot, base.map ? &base : NULL, bf->bits, threads);
+  madvise(bf->mmap, bf->mmap_size, MADV_RANDOM);
+  Py_END_ALLOW_THREADS
+
+  if (failed) {
+    PyErr_Format(PyExc_ValueError, "%s is corrupt", snapshot_path);
+    unlink(tmp);
+    Py_CLEAR(smbo);
+    goto done;
+  }
+  if (rename(tmp, path)) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    unlink(tmp);
+    Py_CLEAR(smbo);
+  }
+
+ done:
+  snapshot_close(&snapshot);
+  snapshot_close(&base);
+  free(tmp);
+  return smbo;
+}
+
 static PyMethodDef peloton_bloomfiltermodule_methods[] = {
   {"_compute_unsigned_magic_info", peloton_bloomfilter_compute_unsigned_magic_info, METH_VARARGS | METH_KEYWORDS, "Compute divide by multiply constants"},
+  {"plan", (PyCFunction)peloton_bloomfilter_plan, METH_VARARGS | METH_KEYWORDS, "plan(capacity, error_rate, objective='memory', layout='standard'): exact bits, probes and predicted error rate for a filter"},
+  {"import_snapshot", (PyCFunction)peloton_bloomfilter_import_snapshot, METH_VARARGS | METH_KEYWORDS, "import_snapshot(snapshot, file, base=None, threads=0): restore a snapshot into a new SharedMemoryBloomFilter file"},
     {NULL, NULL, 0, NULL}
 };
 
@@ -760,4 +3241,16 @@ initpeloton_bloomfilters(void) {
   PyModule_AddObject(m, "ThreadSafeBloomFilter", (PyObject *)&ThreadSafeBloomfilterType);
   Py_INCREF(&BloomfilterType);
   PyModule_AddObject(m, "BloomFilter", (PyObject *)&BloomfilterType);
+  if (PyType_Ready(&SharedMemoryMultiBloomfilterType) < 0)
+    return;
+  Py_INCREF(&SharedMemoryMultiBloomfilterType);
+  PyModule_AddObject(m, "SharedMemoryMultiBloomFilter", (PyObject *)&SharedMemoryMultiBloomfilterType);
+  if (PyType_Ready(&ShardedSharedMemoryBloomfilterType) < 0)
+    return;
+  Py_INCREF(&ShardedSharedMemoryBloomfilterType);
+  PyModule_AddObject(m, "ShardedSharedMemoryBloomFilter", (PyObject *)&ShardedSharedMemoryBloomfilterType);
+  if (PyType_Ready(&SharedMemoryCuckooFilterType) < 0)
+    return;
+  Py_INCREF(&SharedMemoryCuckooFilterType);
+  PyModule_AddObject(m, "SharedMemoryCuckooFilter", (PyObject *)&SharedMemoryCuckooFilterType);
 };
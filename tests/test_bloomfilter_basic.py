@@ -1,4 +1,8 @@
+import ctypes
+import os
+import struct
 import tempfile
+import time
 from unittest import TestCase
 
 import peloton_bloomfilters
@@ -98,3 +102,119 @@ class TestSharedMemoryBloomFilter(TestCase, BloomFilterCase):
         self.assertIn(50, bf1)
         self.assertIn(50, bf2)
 
+
+
+class TestPlan(TestCase):
+    def test_fields(self):
+        plan = peloton_bloomfilters.plan(1000, 0.01)
+        self.assertEquals(
+            sorted(plan),
+            ["bits", "capacity", "error_rate", "layout", "predicted_error_rate", "probes"])
+        self.assertEquals(plan["capacity"], 1000)
+        self.assertEquals(plan["layout"], "standard")
+        self.assertLessEqual(plan["predicted_error_rate"], 0.01)
+
+    def test_objectives(self):
+        memory = peloton_bloomfilters.plan(100000, 0.001)
+        latency = peloton_bloomfilters.plan(100000, 0.001, objective="latency")
+        self.assertLess(memory["bits"], latency["bits"])
+        self.assertLess(latency["probes"], memory["probes"])
+        self.assertEquals(peloton_bloomfilters.plan(100000, 0.001, layout="blocked")["bits"] % 512, 0)
+
+    def test_large_blocked(self):
+        started = time.time()
+        for objective in ("memory", "latency"):
+            plan = peloton_bloomfilters.plan(10 ** 10, 0.01, objective=objective, layout="blocked")
+            self.assertLessEqual(plan["predicted_error_rate"], 0.01)
+            self.assertLess(plan["bits"], 10 ** 10 * 20)
+        self.assertLess(time.time() - started, 5)
+
+    def test_oversized(self):
+        for bits in (2 ** 64 - 1, 2 ** 48 + 64, 2 ** 70, -64):
+            plan = peloton_bloomfilters.plan(1000, 0.01)
+            plan["bits"] = bits
+            self.assertRaises(ValueError, peloton_bloomfilters.BloomFilter, plan=plan)
+            with tempfile.NamedTemporaryFile() as f:
+                self.assertRaises(ValueError, peloton_bloomfilters.SharedMemoryBloomFilter, f.name, plan=plan)
+        plan = peloton_bloomfilters.plan(1000, 0.01)
+        plan["probes"] = 2 ** 32 + 3
+        self.assertRaises(ValueError, peloton_bloomfilters.BloomFilter, plan=plan)
+        self.assertRaises(ValueError, peloton_bloomfilters.plan, 2 ** 62, 1e-9)
+
+    def test_oversized_file(self):
+        with tempfile.NamedTemporaryFile() as f:
+            peloton_bloomfilters.SharedMemoryBloomFilter(f.name, plan=peloton_bloomfilters.plan(1000, 0.01))
+            with open(f.name, "r+b") as raw:
+                raw.seek(48)
+                raw.write(struct.pack("=Q", 2 ** 64 - 1))
+            self.assertRaises(IOError, peloton_bloomfilters.SharedMemoryBloomFilter, f.name)
+
+    def test_invalid(self):
+        self.assertRaises(ValueError, peloton_bloomfilters.plan, 1000, 0.01, objective="speed")
+        self.assertRaises(ValueError, peloton_bloomfilters.plan, 1000, 0.01, layout="sparse")
+        self.assertRaises(ValueError, peloton_bloomfilters.plan, 1000, 1.5)
+        self.assertRaises(TypeError, peloton_bloomfilters.BloomFilter, plan="standard")
+
+
+class TestPlannedBloomFilter(TestCase, BloomFilterCase):
+    def setUp(self):
+        self.bloomfilter = peloton_bloomfilters.BloomFilter(plan=peloton_bloomfilters.plan(50, 0.001))
+
+class TestPlannedThreadSafeBloomFilter(TestCase, BloomFilterCase):
+    def setUp(self):
+        self.bloomfilter = peloton_bloomfilters.ThreadSafeBloomFilter(
+            plan=peloton_bloomfilters.plan(50, 0.001, layout="blocked"))
+
+
+class TestPlannedSharedMemoryBloomFilter(TestCase, BloomFilterCase):
+    def setUp(self):
+        self.fd = tempfile.NamedTemporaryFile()
+        self.plan = peloton_bloomfilters.plan(50, 0.001, objective="latency", layout="blocked")
+        self.bloomfilter = peloton_bloomfilters.SharedMemoryBloomFilter(self.fd.name, plan=self.plan)
+
+    def tearDown(self):
+        self.fd.close()
+
+    def test_reopen(self):
+        for i in xrange(20):
+            self.bloomfilter.add(i)
+        # The planned shape is stored in the file and wins over arguments.
+        bf2 = peloton_bloomfilters.SharedMemoryBloomFilter(self.fd.name, 50, 0.001)
+        self.assertEquals(len(bf2), 20)
+        for i in xrange(20):
+            self.assertIn(i, bf2)
+        self.assertEquals(bf2.population(), self.bloomfilter.population())
+
+
+class TestLegacyFile(TestCase):
+    # Older versions wrote files 56 bytes short of the bit array and kept
+    # the last bits in the page cache past EOF, through their mapping.
+    def test_tail_survives_reopen(self):
+        libc = ctypes.CDLL(None, use_errno=True)
+        libc.mmap.restype = ctypes.c_void_p
+        libc.mmap.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_long]
+        libc.munmap.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+        with tempfile.NamedTemporaryFile() as f:
+            capacity = 1000
+            while True:
+                peloton_bloomfilters.SharedMemoryBloomFilter(f.name, capacity, 0.01)
+                size = os.path.getsize(f.name) - 56
+                if size % 4096 <= 4096 - 56:
+                    break
+                f.truncate(0)
+                capacity += 10
+            f.truncate(size)
+            fd = os.open(f.name, os.O_RDWR)
+            region = libc.mmap(None, size + 56, 3, 1, fd, 0)  # PROT_READ|PROT_WRITE, MAP_SHARED
+            self.assertNotEqual(region, ctypes.c_void_p(-1).value)
+            try:
+                ctypes.memset(region + size, 0xff, 56)
+                bf = peloton_bloomfilters.SharedMemoryBloomFilter(f.name)
+                self.assertEquals(bf.population(), 56 * 8)
+                self.assertEquals(os.path.getsize(f.name), size + 56)
+                with open(f.name, "rb") as raw:
+                    raw.seek(size)
+                    self.assertEquals(raw.read(), "\xff" * 56)
+            finally:
+                libc.munmap(region, size + 56)
+                os.close(fd)
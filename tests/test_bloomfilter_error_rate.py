@@ -1,7 +1,8 @@
+from math import sqrt
 from tempfile import NamedTemporaryFile
 from unittest import TestCase
 
-from peloton_bloomfilters import BloomFilter, ThreadSafeBloomFilter, SharedMemoryBloomFilter
+from peloton_bloomfilters import BloomFilter, ThreadSafeBloomFilter, SharedMemoryBloomFilter, plan
 
 
 
@@ -44,3 +45,30 @@ class TestErrorRate(TestCase, Case):
             sum(v in bf for v in xrange(count, count*2)),
             errors)
 
+
+
+class PlannedCase(object):
+    def test(self):
+        for p in (0.1, 0.01, 0.001, 0.0001):
+            for objective in ('memory', 'latency'):
+                for layout in ('standard', 'blocked'):
+                    self.assert_predicted(plan(10001, p, objective=objective, layout=layout))
+
+    def assert_predicted(self, shape, count=10000, probes=100000):
+        self.assertLessEqual(shape['predicted_error_rate'], shape['error_rate'])
+        bf = self.make(shape)
+        for v in xrange(count):
+            bf.add(v)
+        measured = sum(v in bf for v in xrange(count, count + probes)) / float(probes)
+        predicted = shape['predicted_error_rate']
+        tolerance = 4 * sqrt(predicted * (1 - predicted) / probes) + 1.0 / probes
+        self.assertLessEqual(abs(measured - predicted), tolerance, (shape, measured))
+
+class TestPlannedErrorRate(TestCase, PlannedCase):
+    def make(self, shape):
+        return BloomFilter(plan=shape)
+
+class TestPlannedSharedMemoryErrorRate(TestCase, PlannedCase):
+    def make(self, shape):
+        with NamedTemporaryFile() as f:
+            return SharedMemoryBloomFilter(f.name, plan=shape)
@@ -0,0 +1,130 @@
+import errno
+import os
+import shutil
+import struct
+import tempfile
+import threading
+from unittest import TestCase
+
+import peloton_bloomfilters
+from peloton_bloomfilters import SharedMemoryBloomFilter, import_snapshot
+
+
+class TestSnapshot(TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.bloomfilter = SharedMemoryBloomFilter(self.path("filter"), 200000, 0.001)
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def path(self, name):
+        return os.path.join(self.dir, name)
+
+    def assert_same(self, bf1, bf2, count):
+        self.assertEquals(len(bf1), len(bf2))
+        self.assertEquals(bf1.population(), bf2.population())
+        self.assertEquals(
+            [v in bf1 for v in xrange(count * 2)],
+            [v in bf2 for v in xrange(count * 2)])
+
+    def test_empty(self):
+        self.bloomfilter.export_snapshot(self.path("snapshot"))
+        self.assertLess(
+            os.path.getsize(self.path("snapshot")) * 100,
+            os.path.getsize(self.path("filter")))
+        restored = import_snapshot(self.path("snapshot"), self.path("restored"))
+        self.assertEquals(restored.population(), 0)
+        self.assertEquals(len(restored), 0)
+
+    def test_round_trip(self):
+        for count in (10, 1000, 100000):
+            for v in xrange(count):
+                self.bloomfilter.add(v)
+            self.bloomfilter.export_snapshot(self.path("snapshot"))
+            for threads in (1, 3):
+                restored = import_snapshot(self.path("snapshot"), self.path("restored"), threads=threads)
+                self.assert_same(self.bloomfilter, restored, count)
+
+    def test_sparse_is_small(self):
+        for v in xrange(100):
+            self.bloomfilter.add(v)
+        self.bloomfilter.export_snapshot(self.path("snapshot"))
+        self.assertLess(
+            os.path.getsize(self.path("snapshot")) * 50,
+            os.path.getsize(self.path("filter")))
+
+    def test_delta(self):
+        for v in xrange(1000):
+            self.bloomfilter.add(v)
+        self.bloomfilter.export_snapshot(self.path("base"))
+        for v in xrange(1000, 1100):
+            self.bloomfilter.add(v)
+        self.bloomfilter.export_snapshot(self.path("delta"), base=self.path("base"))
+        self.assertLess(os.path.getsize(self.path("delta")), os.path.getsize(self.path("base")))
+
+        restored = import_snapshot(self.path("delta"), self.path("restored"), base=self.path("base"))
+        self.assert_same(self.bloomfilter, restored, 1100)
+
+        self.assertRaises(ValueError, import_snapshot, self.path("delta"), self.path("restored"))
+        self.assertRaises(ValueError, import_snapshot, self.path("delta"), self.path("restored"),
+                          base=self.path("delta"))
+        self.assertRaises(ValueError, self.bloomfilter.export_snapshot, self.path("chained"),
+                          base=self.path("delta"))
+        self.assertFalse(os.path.exists(self.path("chained")))
+
+    def test_restored_is_shared(self):
+        self.bloomfilter.add(1)
+        self.bloomfilter.export_snapshot(self.path("snapshot"))
+        restored = import_snapshot(self.path("snapshot"), self.path("restored"))
+        other = SharedMemoryBloomFilter(self.path("restored"))
+        restored.add(2)
+        self.assertIn(1, other)
+        self.assertIn(2, other)
+
+    def test_not_a_snapshot(self):
+        self.assertRaises(ValueError, import_snapshot, self.path("filter"), self.path("restored"))
+
+    def test_planned(self):
+        for layout in ("standard", "blocked"):
+            filter = SharedMemoryBloomFilter(
+                self.path(layout), plan=peloton_bloomfilters.plan(200000, 0.001, layout=layout))
+            for v in xrange(1000):
+                filter.add(v)
+            filter.export_snapshot(self.path("base"))
+            for v in xrange(1000, 1100):
+                filter.add(v)
+            filter.export_snapshot(self.path("delta"), base=self.path("base"))
+            restored = import_snapshot(self.path("delta"), self.path("restored"), base=self.path("base"))
+            self.assert_same(filter, restored, 1100)
+            self.assertRaises(ValueError, self.bloomfilter.export_snapshot,
+                              self.path("other"), base=self.path("base"))
+
+    def test_oversized_plan(self):
+        filter = SharedMemoryBloomFilter(self.path("planned"), plan=peloton_bloomfilters.plan(1000, 0.01))
+        filter.export_snapshot(self.path("snapshot"))
+        with open(self.path("snapshot"), "r+b") as f:
+            # The plan record follows the 80 byte header.
+            f.seek(80)
+            f.write(struct.pack("=Q", 2 ** 64 - 1))
+        self.assertRaises(ValueError, import_snapshot, self.path("snapshot"), self.path("restored"))
+
+    def test_export_error_leaves_no_temporary(self):
+        os.mkdir(self.path("taken"))
+        with self.assertRaises(IOError) as error:
+            self.bloomfilter.export_snapshot(self.path("taken"))
+        self.assertEquals(error.exception.errno, errno.EISDIR)
+        self.assertEquals(sorted(os.listdir(self.dir)), ["filter", "taken"])
+
+    def test_concurrent_exports(self):
+        for v in xrange(1000):
+            self.bloomfilter.add(v)
+        threads = [threading.Thread(target=self.bloomfilter.export_snapshot, args=(self.path("snapshot"),))
+                   for _ in xrange(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEquals(sorted(os.listdir(self.dir)), ["filter", "snapshot"])
+        restored = import_snapshot(self.path("snapshot"), self.path("restored"))
+        self.assert_same(self.bloomfilter, restored, 1000)
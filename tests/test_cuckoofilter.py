@@ -0,0 +1,114 @@
+import os
+import struct
+import tempfile
+import time
+from unittest import TestCase
+
+import peloton_bloomfilters
+
+
+class TestSharedMemoryCuckooFilter(TestCase):
+    def setUp(self):
+        self.fd = tempfile.NamedTemporaryFile()
+        self.filter = peloton_bloomfilters.SharedMemoryCuckooFilter(self.fd.name, 1000, 0.001)
+
+    def tearDown(self):
+        self.fd.close()
+
+    def test_add(self):
+        self.assertEqual(0, len(self.filter))
+        self.assertNotIn("5", self.filter)
+        self.assertTrue(self.filter.add("5"))
+        self.assertEqual(1, len(self.filter))
+        self.assertIn("5", self.filter)
+
+    def test_remove(self):
+        self.filter.add("5")
+        self.assertTrue(self.filter.remove("5"))
+        self.assertNotIn("5", self.filter)
+        self.assertFalse(self.filter.remove("5"))
+        self.assertEqual(0, len(self.filter))
+
+    def test_full(self):
+        for i in xrange(1000):
+            self.assertTrue(self.filter.add(i))
+        self.assertGreater(self.filter.load_factor(), 0.9)
+        i = 1000
+        while self.filter.add(i):
+            i += 1
+        self.assertLess(self.filter.load_factor(), 1.0)
+        self.assertEqual(i, len(self.filter))
+        for v in xrange(i):
+            self.assertIn(v, self.filter)
+
+    def test_error_rate(self):
+        for i in xrange(1000):
+            self.filter.add(i)
+        self.assertLess(sum(v in self.filter for v in xrange(1000, 101000)), 100)
+
+    def test_clear(self):
+        self.filter.add(1)
+        self.filter.clear()
+        self.assertNotIn(1, self.filter)
+        self.assertEqual(0, self.filter.load_factor())
+
+    def test_sharing(self):
+        cf2 = peloton_bloomfilters.SharedMemoryCuckooFilter(self.fd.name)
+        self.filter.add(1)
+        cf2.add(2)
+        self.assertIn(1, cf2)
+        self.assertIn(2, self.filter)
+        cf2.remove(1)
+        self.assertNotIn(1, self.filter)
+        self.assertEqual(1, len(self.filter))
+
+    def test_version(self):
+        def version():
+            with open(self.fd.name, "rb") as f:
+                f.seek(56)
+                return struct.unpack("=Q", f.read(8))[0]
+        self.assertEqual(0, version())
+        self.filter.add(1)
+        self.assertEqual(0, version())
+        self.filter.remove(1)
+        self.assertEqual(2, version())
+        self.filter.clear()
+        self.assertEqual(4, version())
+
+    def test_lookups_during_kicks(self):
+        with tempfile.NamedTemporaryFile() as f:
+            cf = peloton_bloomfilters.SharedMemoryCuckooFilter(f.name, 10000, 0.001)
+            stable = xrange(0, 5000)
+            for i in stable:
+                cf.add(i)
+            pid = os.fork()
+            if not pid:
+                # Keep the table near full so most inserts evict.
+                cf = peloton_bloomfilters.SharedMemoryCuckooFilter(f.name)
+                i = 1000000
+                while cf.add(i):
+                    i += 1
+                deadline = time.time() + 1
+                j = 1000000
+                while time.time() < deadline:
+                    cf.remove(j)
+                    cf.add(i)
+                    i += 1
+                    j += 1
+                os._exit(0)
+            misses = 0
+            while not os.waitpid(pid, os.WNOHANG)[0]:
+                misses += sum(i not in cf for i in stable)
+            misses += sum(i not in cf for i in stable)
+            self.assertEqual(0, misses)
+
+    def test_fingerprint_bits(self):
+        # Bits per slot: 10 bit prints six to a word, 21 bit prints three.
+        for error_rate, bits in ((1 / 128., 64 / 6.), (0.0001, 64 / 3.), (1e-7, 32)):
+            with tempfile.NamedTemporaryFile() as f:
+                cf = peloton_bloomfilters.SharedMemoryCuckooFilter(f.name, 9500, error_rate)
+                self.assertAlmostEqual((os.path.getsize(f.name) - 64) * 8 / 10000., bits, 1)
+                for i in xrange(9500):
+                    self.assertTrue(cf.add(i))
+                errors = sum(v in cf for v in xrange(9500, 209500))
+                self.assertLess(errors, max(200000 * error_rate, 1))
@@ -0,0 +1,117 @@
+import os
+import struct
+import tempfile
+from unittest import TestCase
+
+import peloton_bloomfilters
+
+
+class TestSharedMemoryMultiBloomFilter(TestCase):
+    def setUp(self):
+        self.fd = tempfile.NamedTemporaryFile()
+        self.bloomfilter = peloton_bloomfilters.SharedMemoryMultiBloomFilter(self.fd.name, 200, 50, 0.001)
+
+    def tearDown(self):
+        self.fd.close()
+
+    def test_lookup(self):
+        self.assertEqual(200, len(self.bloomfilter))
+        self.assertEqual(0, self.bloomfilter.lookup("5"))
+        self.assertNotIn("5", self.bloomfilter)
+        self.assertFalse(self.bloomfilter.add(3, "5"))
+        self.assertFalse(self.bloomfilter.add(130, "5"))
+        self.assertFalse(self.bloomfilter.add(199, "6"))
+        self.assertEquals(self.bloomfilter.lookup("5"), (1 << 3) | (1 << 130))
+        self.assertEquals(self.bloomfilter.lookup("6"), 1 << 199)
+        self.assertIn("5", self.bloomfilter)
+        self.assertEqual(1, self.bloomfilter.count(3))
+        self.assertEqual(0, self.bloomfilter.count(4))
+
+    def test_member_range(self):
+        self.assertRaises(IndexError, self.bloomfilter.add, 200, "5")
+        self.assertRaises(IndexError, self.bloomfilter.add, -1, "5")
+
+    def test_capacity(self):
+        for i in xrange(50):
+            self.assertFalse(self.bloomfilter.add(7, i))
+            self.bloomfilter.add(8, i)
+        self.assertTrue(self.bloomfilter.add(7, 50))
+        for i in xrange(50):
+            self.assertEquals(self.bloomfilter.lookup(i) >> 7 & 1, 0)
+            self.assertEquals(self.bloomfilter.lookup(i) >> 8 & 1, 1)
+        self.assertEquals(self.bloomfilter.lookup(50) >> 7 & 1, 1)
+
+    def test_clear(self):
+        self.bloomfilter.add(1, "a")
+        self.bloomfilter.add(2, "a")
+        self.bloomfilter.clear(1)
+        self.assertEquals(self.bloomfilter.lookup("a"), 1 << 2)
+        self.bloomfilter.clear()
+        self.assertEquals(self.bloomfilter.lookup("a"), 0)
+        self.assertEquals(self.bloomfilter.count(2), 0)
+
+    def test_sharing(self):
+        bf1 = self.bloomfilter
+        bf2 = peloton_bloomfilters.SharedMemoryMultiBloomFilter(self.fd.name, 1)
+        self.assertEquals(len(bf2), 200)
+        bf1.add(10, 1)
+        bf2.add(20, 1)
+        self.assertEquals(bf1.lookup(1), (1 << 10) | (1 << 20))
+        self.assertEquals(bf2.lookup(1), (1 << 10) | (1 << 20))
+
+    def test_header(self):
+        self.bloomfilter.add(3, "5")
+        with open(self.fd.name, "rb") as f:
+            header = f.read(72 + 8 * 4)
+        self.assertEquals(header[:24], "SharedMemory MultiFilter")
+        capacity, error_rate, filters = struct.unpack("=QdQ", header[24:48])
+        self.assertEquals((capacity, error_rate, filters), (50, 0.001, 200))
+        # bits, probes and layout of a planned shape; zero for this one.
+        self.assertEquals(struct.unpack("=3Q", header[48:72]), (0, 0, 0))
+        self.assertEquals(struct.unpack("=4Q", header[72:]), (50, 50, 50, 49))
+
+    def test_wide(self):
+        with tempfile.NamedTemporaryFile() as f:
+            bf = peloton_bloomfilters.SharedMemoryMultiBloomFilter(f.name, 600, 50, 0.001)
+            for member in (0, 63, 64, 255, 256, 511, 512, 599):
+                bf.add(member, "5")
+                bf.add(member, member)
+            bf.add(300, "6")
+            self.assertEquals(
+                bf.lookup("5"),
+                sum(1 << member for member in (0, 63, 64, 255, 256, 511, 512, 599)))
+            self.assertEquals(bf.lookup("6"), 1 << 300)
+            self.assertEquals(bf.lookup("7"), 0)
+            self.assertNotIn("7", bf)
+            for member in (0, 63, 64, 255, 256, 511, 512, 599):
+                self.assertTrue(bf.lookup(member) >> member & 1)
+
+    def test_filters_range(self):
+        with tempfile.NamedTemporaryFile() as f:
+            for filters in (-1, 0, 2 ** 24 + 1):
+                self.assertRaises(ValueError, peloton_bloomfilters.SharedMemoryMultiBloomFilter, f.name, filters)
+            self.assertEquals(os.path.getsize(f.name), 0)
+
+
+class TestPlannedSharedMemoryMultiBloomFilter(TestCase):
+    def setUp(self):
+        self.fd = tempfile.NamedTemporaryFile()
+        self.plan = peloton_bloomfilters.plan(50, 0.001, objective="latency")
+        self.bloomfilter = peloton_bloomfilters.SharedMemoryMultiBloomFilter(self.fd.name, 70, plan=self.plan)
+
+    def tearDown(self):
+        self.fd.close()
+
+    def test_lookup(self):
+        for i in xrange(50):
+            self.bloomfilter.add(i % 70, i)
+        reopened = peloton_bloomfilters.SharedMemoryMultiBloomFilter(self.fd.name, 70)
+        for i in xrange(50):
+            self.assertTrue(reopened.lookup(i) & (1 << (i % 70)))
+
+    def test_blocked(self):
+        with tempfile.NamedTemporaryFile() as f:
+            self.assertRaises(
+                ValueError,
+                peloton_bloomfilters.SharedMemoryMultiBloomFilter,
+                f.name, 70, plan=peloton_bloomfilters.plan(50, 0.001, layout="blocked"))
@@ -0,0 +1,141 @@
+import errno
+import math
+import os
+import random
+import shutil
+import tempfile
+from unittest import TestCase
+
+import peloton_bloomfilters
+
+
+class TestShardedSharedMemoryBloomFilter(TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.path = os.path.join(self.dir, "filter")
+        self.bloomfilter = peloton_bloomfilters.ShardedSharedMemoryBloomFilter(self.path, 4, 200, 0.001)
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def test_files(self):
+        self.assertEquals(
+            sorted(os.listdir(self.dir)),
+            ["filter", "filter.0", "filter.1", "filter.2", "filter.3"])
+
+    def test_reopen(self):
+        for i in xrange(100):
+            self.bloomfilter.add(i)
+        # The shard count comes from the manifest, not the default.
+        reopened = peloton_bloomfilters.ShardedSharedMemoryBloomFilter(self.path)
+        for i in xrange(100):
+            self.assertIn(i, reopened)
+        self.assertEquals(len(reopened), 100)
+        self.assertEquals(len(os.listdir(self.dir)), 5)
+        self.assertRaises(ValueError, peloton_bloomfilters.ShardedSharedMemoryBloomFilter, self.path, 8)
+        self.assertRaises(ValueError, peloton_bloomfilters.ShardedSharedMemoryBloomFilter, self.path, 3)
+
+    def test_default_shards(self):
+        path = os.path.join(self.dir, "default")
+        bf = peloton_bloomfilters.ShardedSharedMemoryBloomFilter(path)
+        self.assertEquals(len(set(bf.shard(i) for i in xrange(1000))), 16)
+
+    def test_add(self):
+        self.assertEqual(0, len(self.bloomfilter))
+        self.assertNotIn("5", self.bloomfilter)
+        self.assertFalse(self.bloomfilter.add("5"))
+        self.assertEqual(1, len(self.bloomfilter))
+        self.assertIn("5", self.bloomfilter)
+
+    def test_shards_are_bloomfilters(self):
+        for i in xrange(100):
+            self.bloomfilter.add(i)
+        for i in xrange(100):
+            shard = peloton_bloomfilters.SharedMemoryBloomFilter(
+                "%s.%d" % (self.path, self.bloomfilter.shard(i)))
+            self.assertIn(i, shard)
+        self.assertEquals(len(set(self.bloomfilter.shard(i) for i in xrange(100))), 4)
+
+    def test_shard_capacity(self):
+        # Each shard holds its share of 50 plus a 4 sigma margin.
+        capacity = int(math.ceil(50 + 4 * math.sqrt(50 * 0.75)))
+        items = [i for i in xrange(1000) if self.bloomfilter.shard(i) == 2][:capacity + 1]
+        other = [i for i in xrange(1000) if self.bloomfilter.shard(i) == 1][:10]
+        for i in other:
+            self.bloomfilter.add(i)
+        for i in items[:capacity]:
+            self.assertFalse(self.bloomfilter.add(i))
+        self.assertTrue(self.bloomfilter.add(items[capacity]))
+        self.assertNotIn(items[0], self.bloomfilter)
+        for i in other:
+            self.assertIn(i, self.bloomfilter)
+
+    def test_fill_to_capacity(self):
+        rng = random.Random(0)
+        for shards, capacity in ((64, 100000), (16, 100000), (16, 1000)):
+            path = os.path.join(self.dir, "full%d_%d" % (shards, capacity))
+            for plan in (None, peloton_bloomfilters.plan(capacity, 0.01)):
+                bf = peloton_bloomfilters.ShardedSharedMemoryBloomFilter(
+                    path + ("p" if plan else ""), shards, capacity, 0.01, plan=plan)
+                keys = ["%x" % rng.getrandbits(64) for _ in xrange(capacity)]
+                self.assertFalse(any([bf.add(key) for key in keys]))
+                self.assertEquals(len(bf), capacity)
+                self.assertEquals(sum(key not in bf for key in keys), 0)
+
+    def test_clear_shard(self):
+        self.bloomfilter.add("a")
+        self.bloomfilter.add("b")
+        self.bloomfilter.clear_shard(self.bloomfilter.shard("a"))
+        self.assertNotIn("a", self.bloomfilter)
+        self.assertRaises(IndexError, self.bloomfilter.clear_shard, 4)
+
+    def test_rotate_shard(self):
+        self.bloomfilter.add("a")
+        shard = self.bloomfilter.shard("a")
+        snapshot = os.path.join(self.dir, "snapshot")
+        self.bloomfilter.rotate_shard(shard, snapshot)
+        self.assertNotIn("a", self.bloomfilter)
+        self.assertIn("a", peloton_bloomfilters.SharedMemoryBloomFilter(snapshot))
+
+    def test_checkpoint_shard(self):
+        self.bloomfilter.add("a")
+        snapshot = os.path.join(self.dir, "snapshot")
+        self.bloomfilter.checkpoint_shard(self.bloomfilter.shard("a"), snapshot)
+        self.assertIn("a", self.bloomfilter)
+        self.assertIn("a", peloton_bloomfilters.SharedMemoryBloomFilter(snapshot))
+
+    def test_checkpoint_error(self):
+        fds = len(os.listdir("/proc/self/fd"))
+        missing = os.path.join(self.dir, "missing", "snapshot")
+        for _ in xrange(10):
+            with self.assertRaises(IOError) as error:
+                self.bloomfilter.checkpoint_shard(0, missing)
+            self.assertEquals(error.exception.errno, errno.ENOENT)
+        self.assertEquals(len(os.listdir("/proc/self/fd")), fds)
+
+    def test_sharing(self):
+        bf2 = peloton_bloomfilters.ShardedSharedMemoryBloomFilter(self.path, 4, 200, 0.001)
+        self.bloomfilter.add(1)
+        bf2.add(2)
+        self.assertIn(2, self.bloomfilter)
+        self.assertIn(1, bf2)
+        self.assertEqual(2, len(bf2))
+
+    def test_plan(self):
+        path = os.path.join(self.dir, "planned")
+        plan = peloton_bloomfilters.plan(200, 0.001, layout="blocked")
+        bf = peloton_bloomfilters.ShardedSharedMemoryBloomFilter(path, 4, plan=plan)
+        for i in xrange(100):
+            bf.add(i)
+        for i in xrange(100):
+            self.assertIn(i, bf)
+        bf.checkpoint_shard(bf.shard(5), os.path.join(self.dir, "snapshot"))
+        self.assertIn(5, peloton_bloomfilters.SharedMemoryBloomFilter(os.path.join(self.dir, "snapshot")))
+
+    def test_node(self):
+        path = os.path.join(self.dir, "unbound")
+        bf = peloton_bloomfilters.ShardedSharedMemoryBloomFilter(path, 4, 200, 0.001, numa=False)
+        self.assertEquals([bf.node(i) for i in xrange(4)], [-1] * 4)
+        for i in xrange(4):
+            self.assertGreaterEqual(self.bloomfilter.node(i), -1)
+        self.assertRaises(IndexError, bf.node, 4)